@@ -0,0 +1,316 @@
+#ifndef __AGGREGATOR_CHUNKEDBUFFER_HPP__
+#define __AGGREGATOR_CHUNKEDBUFFER_HPP__
+
+#include <vector>
+#include <map>
+#include <new>
+#include <utility>
+#include <stdexcept>
+#include <cassert>
+#include <cstddef>
+#include <stdint.h>
+
+namespace aggregator
+{
+    /** Pool of memory chunks, shared by the buffers of a stream aligner.
+     *
+     * Chunks which are given back to the pool are kept in free lists
+     * (one per chunk size) and handed out again on the next allocation of
+     * the same size, so that buffers which grow and shrink repeatedly do
+     * not go through the system allocator.
+     *
+     * Chunks are aligned for any fundamental type. Chunks for over-aligned
+     * types, e.g. fixed size Eigen types with AVX, are allocated with
+     * room for the alignment and kept in free lists of their own.
+     */
+    class ChunkPool
+    {
+	/** free lists, by chunk size and alignment */
+	typedef std::map<std::pair<size_t, size_t>, std::vector<void*> > free_list_map;
+	free_list_map free_chunks;
+
+	/** total size of all the chunks allocated through this pool */
+	size_t allocated_bytes;
+	/** size of the chunks currently in the free lists */
+	size_t free_bytes;
+	/** total size of the chunks given back to the system allocator */
+	size_t reclaimed_bytes;
+
+	ChunkPool( const ChunkPool& );
+	ChunkPool& operator=( const ChunkPool& );
+
+	/** alignment of the memory returned by operator new */
+	static const size_t default_alignment = alignof(std::max_align_t);
+
+	/** allocate a chunk from the system allocator. Over-aligned chunks
+	 * store the pointer to the allocated block right before them */
+	static void* allocateChunk( size_t bytes, size_t alignment )
+	{
+	    if( alignment <= default_alignment )
+		return ::operator new( bytes );
+
+	    char *block = static_cast<char*>( ::operator new( bytes + alignment + sizeof(void*) ) );
+	    uintptr_t chunk = reinterpret_cast<uintptr_t>( block + sizeof(void*) );
+	    chunk = (chunk + alignment - 1) & ~static_cast<uintptr_t>( alignment - 1 );
+	    reinterpret_cast<void**>( chunk )[-1] = block;
+	    return reinterpret_cast<void*>( chunk );
+	}
+
+	static void freeChunk( void* chunk, size_t alignment )
+	{
+	    if( alignment <= default_alignment )
+		::operator delete( chunk );
+	    else
+		::operator delete( static_cast<void**>( chunk )[-1] );
+	}
+
+    public:
+	ChunkPool() : allocated_bytes( 0 ), free_bytes( 0 ), reclaimed_bytes( 0 ) {}
+
+	~ChunkPool()
+	{
+	    for(free_list_map::iterator it = free_chunks.begin(); it != free_chunks.end(); it++)
+	    {
+		for(size_t i = 0; i < it->second.size(); i++)
+		    freeChunk( it->second[i], it->first.second );
+	    }
+	}
+
+	/** @param alignment - the alignment of the chunk, a power of two */
+	void* allocate( size_t bytes, size_t alignment = default_alignment )
+	{
+	    std::vector<void*> &free_list( free_chunks[std::make_pair( bytes, alignment )] );
+	    if( !free_list.empty() )
+	    {
+		void *chunk = free_list.back();
+		free_list.pop_back();
+		free_bytes -= bytes;
+		return chunk;
+	    }
+
+	    void *chunk = allocateChunk( bytes, alignment );
+	    allocated_bytes += bytes;
+	    return chunk;
+	}
+
+	/** give a chunk back, with the size and alignment it was allocated
+	 * with */
+	void release( void* chunk, size_t bytes, size_t alignment = default_alignment )
+	{
+	    free_chunks[std::make_pair( bytes, alignment )].push_back( chunk );
+	    free_bytes += bytes;
+	}
+
+	/** @return the total size of the chunks allocated through this pool,
+	 * whether they are in use or not */
+	size_t getAllocatedBytes() const { return allocated_bytes; }
+
+	/** @return the size of the chunks which are currently unused */
+	size_t getFreeBytes() const { return free_bytes; }
+
+	/** @return the size of the chunks which are currently in use */
+	size_t getUsedBytes() const { return allocated_bytes - free_bytes; }
+
+	/** @return the total size of the chunks ever freed by trim() */
+	size_t getReclaimedBytes() const { return reclaimed_bytes; }
+
+	/** Give unused chunks back to the system allocator, until at most
+	 * max_allocated_bytes are allocated or no unused chunk is left.
+	 *
+	 * @return the number of bytes which have been freed
+	 */
+	size_t trim( size_t max_allocated_bytes )
+	{
+	    size_t freed = 0;
+	    for(free_list_map::iterator it = free_chunks.begin(); it != free_chunks.end(); it++)
+	    {
+		std::vector<void*> &free_list( it->second );
+		while( allocated_bytes > max_allocated_bytes && !free_list.empty() )
+		{
+		    freeChunk( free_list.back(), it->first.second );
+		    free_list.pop_back();
+		    allocated_bytes -= it->first.first;
+		    free_bytes -= it->first.first;
+		    freed += it->first.first;
+		}
+		// give back the memory of the free list itself
+		if( free_list.empty() )
+		    std::vector<void*>().swap( free_list );
+	    }
+	    reclaimed_bytes += freed;
+	    return freed;
+	}
+    };
+
+    /** FIFO buffer made of fixed size chunks, taken from a ChunkPool.
+     *
+     * Contrary to a circular buffer, growing the buffer only links a new
+     * chunk, and never relocates the elements which are already stored.
+     * Chunks which have been drained are given back to the pool. The
+     * buffer can optionally be bounded to a maximum number of elements,
+     * in which case full() returns true once that number is reached.
+     */
+    template <class V> class ChunkedBuffer
+    {
+    public:
+	/** number of elements per chunk, a power of two */
+	static const size_t chunk_size =
+	    sizeof(V) >= 1024 ? 4 :
+	    sizeof(V) >= 256 ? 16 :
+	    sizeof(V) >= 64 ? 32 : 64;
+	static const size_t chunk_bytes = chunk_size * sizeof(V);
+
+    private:
+	ChunkPool *pool;
+	/** ring of chunk pointers, its size is a power of two */
+	std::vector<V*> chunks;
+	/** position of the first chunk in the ring */
+	size_t first_chunk;
+	/** number of chunks in use */
+	size_t chunk_count;
+	/** position of the first element in the first chunk */
+	size_t head;
+	/** number of elements in the buffer */
+	size_t count;
+	/** maximum number of elements, 0 for unbounded */
+	size_t max_size;
+
+	ChunkedBuffer( const ChunkedBuffer& );
+
+	V* chunk( size_t i ) const
+	{
+	    return chunks[(first_chunk + i) & (chunks.size() - 1)];
+	}
+
+	V* slot( size_t i ) const
+	{
+	    size_t pos = head + i;
+	    return chunk( pos / chunk_size ) + (pos % chunk_size);
+	}
+
+	/** make room for one more element at the back */
+	V* reserveBack()
+	{
+	    size_t pos = head + count;
+	    if( pos == chunk_count * chunk_size )
+	    {
+		if( chunk_count == chunks.size() )
+		    growRing();
+		chunks[(first_chunk + chunk_count) & (chunks.size() - 1)] =
+		    static_cast<V*>( pool->allocate( chunk_bytes, alignof(V) ) );
+		chunk_count++;
+	    }
+	    return chunk( pos / chunk_size ) + (pos % chunk_size);
+	}
+
+	/** double the size of the chunk pointer ring. Only the pointers are
+	 * moved, not the elements */
+	void growRing()
+	{
+	    std::vector<V*> ring( chunks.empty() ? 4 : chunks.size() * 2 );
+	    for(size_t i = 0; i < chunk_count; i++)
+		ring[i] = chunk( i );
+	    chunks.swap( ring );
+	    first_chunk = 0;
+	}
+
+	void releaseFirstChunk()
+	{
+	    pool->release( chunks[first_chunk], chunk_bytes, alignof(V) );
+	    first_chunk = (first_chunk + 1) & (chunks.size() - 1);
+	    chunk_count--;
+	    head = 0;
+	}
+
+    public:
+	explicit ChunkedBuffer( ChunkPool &pool, size_t max_size = 0 )
+	    : pool( &pool ), first_chunk( 0 ), chunk_count( 0 ), head( 0 ), count( 0 ), max_size( max_size ) {}
+
+	~ChunkedBuffer()
+	{
+	    clear();
+	    if( chunk_count )
+		releaseFirstChunk();
+	}
+
+	/** replace the content of this buffer by a copy of the content of
+	 * other. The maximum size is copied as well, but the chunks are
+	 * taken from this buffer's pool. */
+	ChunkedBuffer& operator=( const ChunkedBuffer& other )
+	{
+	    if( this == &other )
+		return *this;
+
+	    clear();
+	    max_size = other.max_size;
+	    for(size_t i = 0; i < other.size(); i++)
+		push_back( other[i] );
+	    return *this;
+	}
+
+	bool empty() const { return count == 0; }
+	size_t size() const { return count; }
+	bool full() const { return max_size && count >= max_size; }
+
+	/** @return the number of elements which fit in the chunks
+	 * currently held by the buffer */
+	size_t capacity() const { return chunk_count * chunk_size; }
+
+	size_t getMaxSize() const { return max_size; }
+	void setMaxSize( size_t size ) { max_size = size; }
+
+	V& operator[]( size_t i ) { return *slot( i ); }
+	const V& operator[]( size_t i ) const { return *slot( i ); }
+
+	V& front() { return *slot( 0 ); }
+	const V& front() const { return *slot( 0 ); }
+	V& back() { return *slot( count - 1 ); }
+	const V& back() const { return *slot( count - 1 ); }
+
+	void push_back( const V& value )
+	{
+	    new( reserveBack() ) V( value );
+	    count++;
+	}
+
+	void push_back( V&& value )
+	{
+	    new( reserveBack() ) V( std::move(value) );
+	    count++;
+	}
+
+	/** construct a new element directly in its slot at the back */
+	template <class... Args> void emplace_back( Args&&... args )
+	{
+	    new( reserveBack() ) V( std::forward<Args>(args)... );
+	    count++;
+	}
+
+	void pop_front()
+	{
+	    assert( count );
+	    slot( 0 )->~V();
+	    head++;
+	    count--;
+
+	    if( count == 0 )
+	    {
+		// keep the last chunk, so that a stream which is regularly
+		// emptied does not have to fetch a chunk for each sample
+		while( chunk_count > 1 )
+		    releaseFirstChunk();
+		head = 0;
+	    }
+	    else if( head == chunk_size )
+		releaseFirstChunk();
+	}
+
+	void clear()
+	{
+	    while( count )
+		pop_front();
+	}
+    };
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef __AGGREGATOR_INGESTQUEUE_HPP__
+#define __AGGREGATOR_INGESTQUEUE_HPP__
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstddef>
+
+namespace aggregator
+{
+    /** Bounded lock-free queue with any number of producer threads and a
+     * single consumer thread.
+     *
+     * Each slot carries a sequence number which tells whether it is free
+     * for the producer which reserved it, or holds a value ready for the
+     * consumer. Producers reserve slots with a compare-and-swap on the
+     * enqueue position, so they never wait on each other, and the consumer
+     * never waits on the producers. A push on a full queue fails instead
+     * of blocking.
+     */
+    template <class V> class IngestQueue
+    {
+	struct cell
+	{
+	    std::atomic<size_t> sequence;
+	    typename std::aligned_storage<sizeof(V), std::alignment_of<V>::value>::type storage;
+
+	    V* value() { return reinterpret_cast<V*>( &storage ); }
+	};
+
+	std::unique_ptr<cell[]> cells;
+	size_t mask;
+
+	// keep the positions of producers and consumer on separate cache
+	// lines. Padding is used rather than alignas, as C++11 operator new
+	// does not honour extended alignments
+	char pad0[64];
+	std::atomic<size_t> enqueue_pos;
+	char pad1[64];
+	size_t dequeue_pos;
+
+	IngestQueue( const IngestQueue& );
+	IngestQueue& operator=( const IngestQueue& );
+
+    public:
+	/** @param capacity - the maximum number of queued values. It gets
+	 *	rounded up to the next power of two. */
+	explicit IngestQueue( size_t capacity )
+	    : enqueue_pos( 0 ), dequeue_pos( 0 )
+	{
+	    size_t size = 2;
+	    while( size < capacity )
+		size *= 2;
+
+	    cells.reset( new cell[size] );
+	    mask = size - 1;
+	    for(size_t i = 0; i < size; i++)
+		cells[i].sequence.store( i, std::memory_order_relaxed );
+	}
+
+	~IngestQueue()
+	{
+	    while( pop( [](V&){} ) );
+	}
+
+	size_t capacity() const { return mask + 1; }
+
+	/** construct a value from args in the next free slot. Can be called
+	 * from any thread.
+	 *
+	 * @return false if the queue is full, in which case nothing is
+	 *	constructed
+	 */
+	template <class... Args> bool push( Args&&... args )
+	{
+	    size_t pos = enqueue_pos.load( std::memory_order_relaxed );
+	    cell *c;
+	    while( true )
+	    {
+		c = &cells[pos & mask];
+		size_t seq = c->sequence.load( std::memory_order_acquire );
+		std::ptrdiff_t diff = static_cast<std::ptrdiff_t>( seq ) - static_cast<std::ptrdiff_t>( pos );
+		if( diff == 0 )
+		{
+		    if( enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+			break;
+		}
+		else if( diff < 0 )
+		    return false;
+		else
+		    pos = enqueue_pos.load( std::memory_order_relaxed );
+	    }
+
+	    new( c->value() ) V( std::forward<Args>(args)... );
+	    c->sequence.store( pos + 1, std::memory_order_release );
+	    return true;
+	}
+
+	/** hand the oldest value to f and remove it from the queue. Must
+	 * only be called from the consumer thread.
+	 *
+	 * @return false if there is no value ready
+	 */
+	template <class F> bool pop( F f )
+	{
+	    cell *c = &cells[dequeue_pos & mask];
+	    size_t seq = c->sequence.load( std::memory_order_acquire );
+	    if( seq != dequeue_pos + 1 )
+		return false;
+
+	    f( *c->value() );
+	    c->value()->~V();
+	    c->sequence.store( dequeue_pos + mask + 1, std::memory_order_release );
+	    dequeue_pos++;
+	    return true;
+	}
+    };
+}
+
+#endif
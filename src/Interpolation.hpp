@@ -0,0 +1,72 @@
+#ifndef _AGGREGATOR_INTERPOLATION_HPP_
+#define _AGGREGATOR_INTERPOLATION_HPP_
+
+#include <utility>
+#include <base/Time.hpp>
+#include <base/samples/RigidBodyState.hpp>
+
+namespace aggregator
+{
+
+/**
+ * Trait used by StreamAligner::interpolateAt to compute a sample at a time
+ * between two samples of a stream.
+ *
+ * The default interpolates linearly, for types with the arithmetic
+ * operators, e.g. double or Eigen vectors. Other types can specialize the
+ * trait in the aggregator namespace, in the same way as SampleSize:
+ * namespace aggregator {
+ *      template<> struct Interpolation<some_namespace::SomeSampleType>
+ *      {
+ *          static void interpolate(const base::Time &time,
+ *              const std::pair<base::Time, some_namespace::SomeSampleType> &before,
+ *              const std::pair<base::Time, some_namespace::SomeSampleType> &after,
+ *              some_namespace::SomeSampleType &result) {...}
+ *      };
+ * }
+ */
+template<typename T>
+struct Interpolation
+{
+    /** @return the position of time between the times of two samples, from
+     * 0 at before to 1 at after */
+    static double getRatio(const base::Time &time, const base::Time &before, const base::Time &after)
+    {
+        return (time - before).toSeconds() / (after - before).toSeconds();
+    }
+
+    static void interpolate(const base::Time &time,
+            const std::pair<base::Time, T> &before, const std::pair<base::Time, T> &after,
+            T &result)
+    {
+        const double ratio = getRatio(time, before.first, after.first);
+        result = before.second + (after.second - before.second) * ratio;
+    }
+};
+
+/** Interpolates position and velocities linearly and the orientation
+ * spherically. The frames and covariances are the ones of the closest
+ * sample. */
+template<>
+struct Interpolation<base::samples::RigidBodyState>
+{
+    static void interpolate(const base::Time &time,
+            const std::pair<base::Time, base::samples::RigidBodyState> &before,
+            const std::pair<base::Time, base::samples::RigidBodyState> &after,
+            base::samples::RigidBodyState &result)
+    {
+        const double ratio = Interpolation<double>::getRatio(time, before.first, after.first);
+        const base::samples::RigidBodyState &a(before.second);
+        const base::samples::RigidBodyState &b(after.second);
+        result = ratio <= 0.5 ? a : b;
+        result.time = time;
+        result.position = a.position + (b.position - a.position) * ratio;
+        result.orientation = a.orientation.slerp(ratio, b.orientation);
+        result.velocity = a.velocity + (b.velocity - a.velocity) * ratio;
+        result.angular_velocity = a.angular_velocity + (b.angular_velocity - a.angular_velocity) * ratio;
+    }
+};
+
+}
+
+#endif
@@ -2,26 +2,210 @@
 #define __AGGREGATORE_PULLSTREAMALIGNER__
 
 #include <aggregator/StreamAligner.hpp>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 namespace aggregator
 {
     class PullStreamAligner : public StreamAligner
     {
+    public:
+	/** callback which positions a source so that its next sample is the
+	 * first one at or after the given time */
+	typedef boost::function<void (const base::Time&)> seek_callback_t;
+
+    private:
+	/** Bounded queue of samples, filled ahead of consumption by a worker
+	 * thread which runs the pull callback of a stream.
+	 *
+	 * When the callback returns false, the worker stops until the
+	 * consumer has seen it, and then calls the callback again once per
+	 * consumer pull, which is what pulling without prefetch does. The
+	 * consumer does not wait for these retries.
+	 *
+	 * The pull callback is a reference to the one of the stream, so that
+	 * both the worker and the pulls done while the worker is stopped use
+	 * the current callback of the stream.
+	 */
+	template <class T> class PrefetchQueue
+	{
+	public:
+	    typedef boost::function<bool (base::Time&, T&)> pull_callback_t;
+
+	    explicit PrefetchQueue( const pull_callback_t &pull_callback )
+		: pull_callback( pull_callback ), capacity( 1 ), no_data( false ), retrying( false ), stopping( false ) {}
+
+	    ~PrefetchQueue()
+	    {
+		stop();
+	    }
+
+	    void start( size_t capacity )
+	    {
+		stop();
+		this->capacity = std::max<size_t>( 1, capacity );
+		stopping = false;
+		worker = std::thread( &PrefetchQueue::run, this );
+	    }
+
+	    /** stop the worker. Samples which are already queued are still
+	     * returned by pull() */
+	    void stop()
+	    {
+		if( !worker.joinable() )
+		    return;
+		{
+		    std::lock_guard<std::mutex> lock( mutex );
+		    stopping = true;
+		}
+		cond.notify_all();
+		worker.join();
+	    }
+
+	    bool isRunning() const { return worker.joinable(); }
+
+	    /** discard the queued samples. Must only be called while the
+	     * worker is stopped. */
+	    void clear()
+	    {
+		queue.clear();
+		no_data = false;
+		retrying = false;
+		error = std::exception_ptr();
+	    }
+
+	    /** discard the queued samples older than ts. Must only be called
+	     * while the worker is stopped. */
+	    void discardBefore( const base::Time &ts )
+	    {
+		while( !queue.empty() && queue.front().first < ts )
+		    queue.pop_front();
+	    }
+
+	    /** take the next sample, waiting for the worker if it has not
+	     * decided yet whether there is one. Rethrows the exceptions of the
+	     * pull callback. */
+	    bool pull( base::Time &ts, T &data )
+	    {
+		std::unique_lock<std::mutex> lock( mutex );
+		if( worker.joinable() )
+		    cond.wait( lock, [this]{ return !queue.empty() || no_data || retrying || error; } );
+		else if( queue.empty() && !error )
+		{
+		    lock.unlock();
+		    return pull_callback( ts, data );
+		}
+
+		if( !queue.empty() )
+		{
+		    ts = queue.front().first;
+		    data = std::move( queue.front().second );
+		    queue.pop_front();
+		    cond.notify_all();
+		    return true;
+		}
+		if( error )
+		{
+		    std::exception_ptr e;
+		    std::swap( e, error );
+		    cond.notify_all();
+		    std::rethrow_exception( e );
+		}
+		if( no_data )
+		{
+		    no_data = false;
+		    retrying = true;
+		    cond.notify_all();
+		}
+		return false;
+	    }
+
+	private:
+	    void run()
+	    {
+		std::unique_lock<std::mutex> lock( mutex );
+		while( true )
+		{
+		    cond.wait( lock, [this]{ return stopping || (!no_data && !error && queue.size() < capacity); } );
+		    if( stopping )
+			return;
+
+		    lock.unlock();
+		    std::pair<base::Time, T> sample;
+		    bool has_sample = false;
+		    std::exception_ptr e;
+		    try
+		    {
+			has_sample = pull_callback( sample.first, sample.second );
+		    }
+		    catch( ... )
+		    {
+			e = std::current_exception();
+		    }
+		    lock.lock();
+
+		    retrying = false;
+		    if( e )
+			error = e;
+		    else if( has_sample )
+			queue.push_back( std::move( sample ) );
+		    else
+			no_data = true;
+		    cond.notify_all();
+		}
+	    }
+
+	    const pull_callback_t &pull_callback;
+	    size_t capacity;
+	    std::deque< std::pair<base::Time, T> > queue;
+	    /** the callback returned false, and the consumer did not see it yet */
+	    bool no_data;
+	    /** the consumer saw no_data, and the worker calls the callback again */
+	    bool retrying;
+	    bool stopping;
+	    std::exception_ptr error;
+	    std::mutex mutex;
+	    std::condition_variable cond;
+	    std::thread worker;
+	};
+
 	class PullStreamBase 
 	{
 	public:
-	    PullStreamBase() : has_data(false) {}
+	    PullStreamBase() : has_data(false), priority(0), stream_idx(0) {}
 	    virtual ~PullStreamBase() {}
 	    virtual void pull() = 0;
 	    virtual void push() = 0; 
+	    virtual void dispatch() = 0; 
 	    virtual void copyState( const PullStreamBase& other ) = 0; 
+	    virtual void seek( const base::Time &ts ) = 0;
+	    virtual void startPrefetch( size_t queue_size ) = 0;
+	    virtual void stopPrefetch() = 0;
+	    virtual bool isPrefetching() const = 0;
 
 	    base::Time lastTime() const { return last_ts; }
 	    bool hasData() const { return has_data; }
 
+	    /** ordering of the streams in the merge, which is the order of
+	     * (time, priority, stream index) of their pulled samples. Only
+	     * valid for streams which have data. */
+	    bool operator<( const PullStreamBase& other ) const
+	    {
+		if( last_ts != other.last_ts )
+		    return last_ts < other.last_ts;
+		if( priority != other.priority )
+		    return priority < other.priority;
+		return stream_idx < other.stream_idx;
+	    }
+
 	protected:
 	    base::Time last_ts;
 	    bool has_data;
+	    int priority;
+	    int stream_idx;
 	};
 
 	template <class T> class PullStream : public PullStreamBase 
@@ -29,18 +213,68 @@ namespace aggregator
 	public:
 	    typedef boost::function<bool (base::Time&, T&)> pull_callback_t;
 
-	    PullStream( pull_callback_t pull_callback, StreamAligner* sa, size_t stream_index )
-		: stream_idx( stream_index ), sa( sa ), pull_callback( pull_callback ) {}
+	    PullStream( pull_callback_t pull_callback, seek_callback_t seek_callback, PullStreamAligner* sa, size_t stream_index, int priority )
+		: sa( sa ), pull_callback( pull_callback ), seek_callback( seek_callback ) 
+	    {
+		this->stream_idx = stream_index;
+		this->priority = priority;
+	    }
 
+	    /** pull the next sample. If the callback throws, the stream
+	     * is left without data, so that it is pulled again */
 	    void pull()
 	    {
-		has_data = pull_callback( last_ts, last_data );
+		bool pulled;
+		do
+		{
+		    if( prefetch )
+			pulled = prefetch->pull( last_ts, last_data );
+		    else
+			pulled = pull_callback( last_ts, last_data );
+		}
+		while( pulled && last_ts < skip_before );
+
+		has_data = pulled;
+		if( has_data )
+		    skip_before = base::Time();
+	    }
+
+	    /** Position the source at the given time. Sources without seek
+	     * callback, and sources which seek to an earlier sample, are
+	     * pulled until they reach that time. Sources without seek
+	     * callback keep the samples already pulled at or after that
+	     * time. Must only be called while the prefetch is stopped. */
+	    void seek( const base::Time &ts )
+	    {
+		if( seek_callback )
+		{
+		    if( prefetch )
+			prefetch->clear();
+		    has_data = false;
+		    seek_callback( ts );
+		}
+		else
+		{
+		    if( has_data && last_ts < ts )
+			has_data = false;
+		    if( prefetch )
+			prefetch->discardBefore( ts );
+		}
+		skip_before = ts;
 	    }
 
 	    void push()
 	    {
 		if( has_data )
-		    sa->push( stream_idx, last_ts, last_data );
+		    sa->push( stream_idx, last_ts, std::move(last_data) );
+
+		has_data = false;	
+	    }
+
+	    void dispatch()
+	    {
+		if( has_data )
+		    sa->dispatch( stream_idx, last_ts, last_data );
 
 		has_data = false;	
 	    }
@@ -48,54 +282,239 @@ namespace aggregator
 	    void copyState( const PullStreamBase& other )
 	    {
 		const PullStream<T> &pull_stream(static_cast<const PullStream<T>& >(other));
-		operator=( pull_stream );
+		last_ts = pull_stream.last_ts;
+		has_data = pull_stream.has_data;
+		last_data = pull_stream.last_data;
+		pull_callback = pull_stream.pull_callback;
+		seek_callback = pull_stream.seek_callback;
+		skip_before = pull_stream.skip_before;
+	    }
+
+	    void startPrefetch( size_t queue_size )
+	    {
+		// the queue is kept once created, as it may still hold samples
+		// after the prefetch got stopped
+		if( !prefetch )
+		    prefetch.reset( new PrefetchQueue<T>( pull_callback ) );
+		prefetch->start( queue_size );
+	    }
+
+	    void stopPrefetch()
+	    {
+		if( prefetch )
+		    prefetch->stop();
+	    }
+
+	    bool isPrefetching() const
+	    {
+		return prefetch && prefetch->isRunning();
 	    }
 
 	protected:
-	    int stream_idx;
-	    StreamAligner *sa;
+	    PullStreamAligner *sa;
 
 	    pull_callback_t pull_callback;
+	    seek_callback_t seek_callback;
 	    T last_data;
+	    /** samples before that time are skipped after a seek, null if none */
+	    base::Time skip_before;
+	    std::unique_ptr< PrefetchQueue<T> > prefetch;
 	};
 
-	static bool comparePullStreams( const PullStreamBase* b1, const PullStreamBase* b2 )
+	/** heap order of merge_heap, which puts the earliest stream on top */
+	static bool laterPullStream( const PullStreamBase* b1, const PullStreamBase* b2 )
+	{
+	    return *b2 < *b1;
+	}
+
+	/** sort the streams into merge_heap and starved_streams according
+	 * to whether they hold a pulled sample */
+	void rebuildMerge()
 	{
-	    const base::Time &ts1( b1->lastTime() );
-	    const base::Time &ts2( b2->lastTime() );
-	    return ts1 < ts2 || !b2->hasData(); 
+	    merge_heap.clear();
+	    starved_streams.clear();
+	    for(pull_stream_vector::iterator it=pull_streams.begin();it != pull_streams.end();it++)
+	    {
+		if( (*it)->hasData() )
+		    merge_heap.push_back( *it );
+		else
+		    starved_streams.push_back( *it );
+	    }
+	    std::make_heap( merge_heap.begin(), merge_heap.end(), &laterPullStream );
 	}
 
     public:
+	explicit PullStreamAligner( base::Time timeout = base::Time::fromSeconds(1) )
+	    : StreamAligner( timeout ), prefetch_size( 0 ), direct_dispatch( false ) {}
+
+	/** @param seek_callback - optional callback used by seek() to
+	 *	position the source. Without it, seek() pulls the samples up to
+	 *	the seek time.
+	 */
 	template <class T> 
 	int registerStream( typename PullStream<T>::pull_callback_t pull_callback, 
-		typename Stream<T>::callback_t callback, int bufferSize, base::Time period, int priority  = -1 ) 
+		typename Stream<T>::callback_t callback, int bufferSize, base::Time period, int priority  = -1,
+		seek_callback_t seek_callback = seek_callback_t() ) 
 	{
 	    int idx = StreamAligner::registerStream<T>( callback, bufferSize, period, priority );
-	    pull_streams.push_back( new PullStream<T>( pull_callback, this, idx ) );
+	    pull_streams.push_back( new PullStream<T>( pull_callback, seek_callback, this, idx, priority ) );
+	    starved_streams.push_back( pull_streams.back() );
+	    if( prefetch_size )
+		pull_streams.back()->startPrefetch( prefetch_size );
 	    return idx;
 	}
 
-	bool pull()
+	/** Call the pull callbacks ahead of consumption, from one worker
+	 * thread per stream, so that decoding the samples of all streams
+	 * runs in parallel with the merge. This also applies to the streams
+	 * registered later.
+	 *
+	 * pull() then only waits when a stream has no sample queued and its
+	 * worker is still running the callback. The callback of a stream is
+	 * never called concurrently with itself, but callbacks of different
+	 * streams are. A stream whose callback returned false is pulled
+	 * again on each call of pull(), without waiting, so that new data
+	 * is seen one pull later than without prefetch. Exceptions of a pull
+	 * callback are rethrown by pull(). The sources have to outlive the
+	 * aligner, or the prefetch has to be disabled before they go away.
+	 *
+	 * @param queue_size - the maximum number of samples pulled ahead,
+	 *	per stream
+	 */
+	void enablePrefetch( size_t queue_size = 16 )
+	{
+	    prefetch_size = std::max<size_t>( 1, queue_size );
+	    for(pull_stream_vector::iterator it=pull_streams.begin();it != pull_streams.end();it++)
+		(*it)->startPrefetch( prefetch_size );
+	}
+
+	/** Stop the prefetch worker threads. The samples which have already
+	 * been pulled ahead are still pushed by pull(). */
+	void disablePrefetch()
+	{
+	    prefetch_size = 0;
+	    for(pull_stream_vector::iterator it=pull_streams.begin();it != pull_streams.end();it++)
+		(*it)->stopPrefetch();
+	}
+
+	bool isPrefetchEnabled() const { return prefetch_size; }
+
+	/** Hand the samples merged by pull() straight to the stream
+	 * callbacks, instead of pushing them into the stream buffers to be
+	 * played out by step().
+	 *
+	 * This is meant for offline processing, where all streams are pull
+	 * streams: the samples are neither copied into a buffer nor sorted
+	 * again, and the timeout does not apply. The callbacks are called in
+	 * the order step() would have used, i.e. by time, then by stream
+	 * priority, then by stream index. Samples pushed directly into the
+	 * aligner are still buffered and played out by step().
+	 *
+	 * @throws std::runtime_error when enabling while samples are
+	 *	buffered, as the order with these would not be kept. Play them
+	 *	out with step() first.
+	 */
+	void setDirectDispatch( bool enable )
 	{
+	    if( enable && hasBufferedSamples() )
+		throw std::runtime_error("PullStreamAligner::setDirectDispatch: samples are still buffered");
+	    direct_dispatch = enable;
+	}
+
+	bool isDirectDispatch() const { return direct_dispatch; }
+
+	/** Restart the replay at the given time.
+	 *
+	 * The aligner is cleared, all sources are positioned with their seek
+	 * callback, and the merge restarts, so that the next pull() returns
+	 * the first sample at or after ts. Samples before ts are skipped for
+	 * the sources which have no seek callback, or whose seek callback
+	 * lands on an earlier sample (e.g. on the previous key frame). The
+	 * sources without seek callback can therefore only seek forward, and
+	 * the samples already pulled from them at or after ts are kept.
+	 * Prefetch workers are stopped while seeking, so the seek callbacks
+	 * are never called concurrently with the pull callbacks.
+	 */
+	void seek( const base::Time &ts )
+	{
+	    for(pull_stream_vector::iterator it=pull_streams.begin();it != pull_streams.end();it++)
+		(*it)->stopPrefetch();
+
+	    clear();
 	    for(pull_stream_vector::iterator it=pull_streams.begin();it != pull_streams.end();it++)
+		(*it)->seek( ts );
+	    rebuildMerge();
+
+	    if( prefetch_size )
 	    {
-		if( !(*it)->hasData() )
-		    (*it)->pull();
+		for(pull_stream_vector::iterator it=pull_streams.begin();it != pull_streams.end();it++)
+		    (*it)->startPrefetch( prefetch_size );
 	    }
-	    std::sort( pull_streams.begin(), pull_streams.end(), &comparePullStreams );
+	}
 
-	    PullStreamBase *first = pull_streams.front();
-	    if( first->hasData() )
+	/** Push the earliest sample of all pull streams into the aligner,
+	 * or hand it to its callback with direct dispatch.
+	 *
+	 * The pull callbacks are called for the streams which do not hold a
+	 * sample, i.e. the stream consumed by the previous call and the
+	 * streams which had no data so far. The streams holding a sample are
+	 * kept in a heap, so that a call costs O(log N) in the number of
+	 * streams with data. Samples with equal times are pushed in the order
+	 * of the stream priorities, then of the registration of the streams.
+	 *
+	 * If a pull callback throws, the exception is passed on. The samples
+	 * pulled from the other streams are kept, and the failing stream and
+	 * the streams after it are pulled again by the next call.
+	 *
+	 * @return true if a sample was pushed, false if none of the streams
+	 *	had data
+	 */
+	bool pull()
+	{
+	    pull_stream_vector::iterator starved_end = starved_streams.begin();
+	    pull_stream_vector::iterator it = starved_streams.begin();
+	    try
 	    {
-		first->push();
-		return true;
+		for(;it != starved_streams.end();it++)
+		{
+		    (*it)->pull();
+		    if( (*it)->hasData() )
+		    {
+			merge_heap.push_back( *it );
+			std::push_heap( merge_heap.begin(), merge_heap.end(), &laterPullStream );
+		    }
+		    else
+			*starved_end++ = *it;
+		}
+	    }
+	    catch( ... )
+	    {
+		// drop the streams moved to the heap, keep the ones not pulled yet
+		starved_streams.erase( starved_end, it );
+		throw;
 	    }
-	    return false;
+	    starved_streams.erase( starved_end, starved_streams.end() );
+
+	    if( merge_heap.empty() )
+		return false;
+
+	    std::pop_heap( merge_heap.begin(), merge_heap.end(), &laterPullStream );
+	    PullStreamBase *first = merge_heap.back();
+	    merge_heap.pop_back();
+	    if( direct_dispatch )
+		first->dispatch();
+	    else
+		first->push();
+	    starved_streams.push_back( first );
+	    return true;
 	}
 
+	/** @throws std::runtime_error if prefetch is enabled on either
+	 * aligner, as the samples pulled ahead cannot be copied */
 	void copyState(const PullStreamAligner& other)
 	{
+	    if( prefetch_size || other.prefetch_size )
+		throw std::runtime_error("PullStreamAligner::copyState is not supported with prefetch");
 	    StreamAligner::copyState( other );
 
 	    assert( pull_streams.size() == other.pull_streams.size() );
@@ -103,17 +522,28 @@ namespace aggregator
 	    {
 		pull_streams[i]->copyState( *other.pull_streams[i] );
 	    }
+	    rebuildMerge();
 	}
 
 	~PullStreamAligner()
 	{
+	    // stop all workers before any stream is destroyed
+	    disablePrefetch();
 	    for(pull_stream_vector::iterator it=pull_streams.begin();it != pull_streams.end();it++)
 		delete *it;
 	}
 
     protected:
 	typedef std::vector<PullStreamBase*> pull_stream_vector;
+	/** all pull streams, in registration order */
 	pull_stream_vector pull_streams;
+	/** the streams which hold a pulled sample, as a heap */
+	pull_stream_vector merge_heap;
+	/** the streams which need to be pulled */
+	pull_stream_vector starved_streams;
+	/** queue size of the prefetch, 0 if disabled */
+	size_t prefetch_size;
+	bool direct_dispatch;
     };
 }
 
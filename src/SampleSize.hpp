@@ -0,0 +1,53 @@
+#ifndef _AGGREGATOR_SAMPLE_SIZE_HPP_
+#define _AGGREGATOR_SAMPLE_SIZE_HPP_
+
+#include <vector>
+#include <string>
+
+namespace aggregator
+{
+
+/**
+ * Trait used by the stream aligner to estimate the memory footprint of a
+ * buffered sample, e.g. for its memory budget.
+ *
+ * The default is sizeof(T), which does not account for memory owned by the
+ * sample. Types which own large amounts of memory should specialize the
+ * trait in the aggregator namespace. E.g.:
+ * namespace aggregator {
+ *      template<> struct SampleSize<some_namespace::SomeSampleType>
+ *      {
+ *          static size_t get(const some_namespace::SomeSampleType& sample) {...}
+ *      };
+ * }
+ */
+template<typename T>
+struct SampleSize
+{
+    static size_t get(const T& sample)
+    {
+        return sizeof(T);
+    }
+};
+
+template<typename T, typename Alloc>
+struct SampleSize< std::vector<T, Alloc> >
+{
+    static size_t get(const std::vector<T, Alloc>& sample)
+    {
+        return sizeof(sample) + sample.capacity() * sizeof(T);
+    }
+};
+
+template<typename Char, typename Traits, typename Alloc>
+struct SampleSize< std::basic_string<Char, Traits, Alloc> >
+{
+    static size_t get(const std::basic_string<Char, Traits, Alloc>& sample)
+    {
+        return sizeof(sample) + sample.capacity() * sizeof(Char);
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef __AGGREGATOR_STATICSTREAMALIGNER_HPP__
+#define __AGGREGATOR_STATICSTREAMALIGNER_HPP__
+
+#include <base/Time.hpp>
+#include <tuple>
+#include <utility>
+#include <limits>
+#include <memory>
+#include <cmath>
+#include <stdexcept>
+#include <aggregator/StreamAlignerStatus.hpp>
+#include <aggregator/ChunkedBuffer.hpp>
+
+namespace aggregator
+{
+    /** Stream of a StaticStreamAligner.
+     *
+     * The callback can be any callable taking (const base::Time&, const
+     * T&). It is stored by value, so that calls to function objects and
+     * lambdas can be inlined. Use makeStaticStream() to have its type
+     * deduced.
+     */
+    template <class T, class Callback> class StaticStream
+    {
+    public:
+	typedef T sample_type;
+	typedef std::pair<base::Time, T> item;
+
+    private:
+	template <class... Streams> friend class StaticStreamAligner;
+
+	/** each stream has a pool of its own, as the streams are built
+	 * before the aligner and copied into it */
+	std::unique_ptr<ChunkPool> pool;
+	ChunkedBuffer<item> buffer;
+	/** the buffer size given at construction, negative if it has to be
+	 * computed from the timeout of the aligner */
+	int bufferSize;
+	Callback callback;
+	base::Time period;
+	base::Time lastTime;
+	int priority;
+	bool active;
+	mutable StreamStatus status;
+
+	StaticStream& operator=( const StaticStream& );
+
+	/** compute the buffer size from the period and the timeout of the
+	 * aligner, if it was not given. @see StreamAligner::registerStream */
+	void setupBuffer( const base::Time &timeout, double buffer_size_factor )
+	{
+	    if( bufferSize >= 0 )
+		return;
+
+	    if( period == base::Time() )
+		throw std::runtime_error("No buffer size provided for stream with unknown period.");
+	    else if( period < base::Time() )
+	    {
+		// for a negative period, just calculate the buffer size, but don't set any lookahead.
+		bufferSize = buffer_size_factor * std::ceil( timeout.toSeconds() / -period.toSeconds() );
+		period = base::Time();
+	    }
+	    else
+		bufferSize = buffer_size_factor * std::ceil( timeout.toSeconds() / period.toSeconds() );
+	    buffer.setMaxSize( bufferSize );
+	}
+
+	template <class... Args> void push( const base::Time &ts, Args&&... args )
+	{
+	    if( ts < lastTime )
+	    {
+		status.samples_backward_in_time++;
+		return;
+	    }
+
+	    lastTime = ts;
+	    // only fixed size buffers get full
+	    if( buffer.full() )
+	    {
+		buffer.pop_front();
+		status.samples_dropped_buffer_full++;
+	    }
+	    buffer.emplace_back( std::piecewise_construct, std::forward_as_tuple( ts ), 
+		    std::forward_as_tuple( std::forward<Args>(args)... ) );
+	}
+
+	base::Time pop()
+	{
+	    status.samples_processed++;
+	    const base::Time ts = buffer.front().first;
+	    callback( ts, buffer.front().second );
+	    buffer.pop_front();
+	    return ts;
+	}
+
+    public:
+	/** @param bufferSize - the number of samples the stream buffers,
+	 *	0 to let the buffer grow as needed, or a negative value to
+	 *	compute it from the period and the timeout of the aligner
+	 *  @param period - the time between two samples, used as lookahead.
+	 *	0 if the stream is not periodic. A negative period is only
+	 *	used to compute the buffer size, as in StreamAligner.
+	 *  @param priority - if streams have data with equal timestamps, the
+	 *	one with the lower priority value is played out first.
+	 */
+	StaticStream( Callback callback, int bufferSize, base::Time period, int priority = -1 )
+	    : pool( new ChunkPool ), buffer( *pool, bufferSize > 0 ? bufferSize : 0 ), bufferSize( bufferSize ),
+	    callback( callback ), period( period ), priority( priority ), active( true )
+	{
+	    status.priority = priority;
+	}
+
+	/** copies the samples into buffers taken from a new pool */
+	StaticStream( const StaticStream &other )
+	    : pool( new ChunkPool ), buffer( *pool ), bufferSize( other.bufferSize ),
+	    callback( other.callback ), period( other.period ), lastTime( other.lastTime ),
+	    priority( other.priority ), active( other.active ), status( other.status )
+	{
+	    buffer = other.buffer;
+	}
+
+	bool hasData() const { return !buffer.empty(); }
+	bool isActive() const { return active; }
+	int getPriority() const { return priority; }
+	base::Time getPeriod() const { return period; }
+
+	const StreamStatus &getBufferStatus() const
+	{
+	    status.buffer_fill = buffer.size();
+	    status.buffer_size = buffer.getMaxSize() ? buffer.getMaxSize() : buffer.capacity();
+	    status.latest_data_time = lastTime;
+	    status.earliest_data_time = hasData() ? buffer.front().first : base::Time();
+	    status.active = active;
+	    return status;
+	}
+
+	void clear()
+	{
+	    lastTime = base::Time();
+	    buffer.clear();
+	    status = StreamStatus();
+	    status.priority = priority;
+	}
+    };
+
+    /** @return a StaticStream with the type of the callback deduced */
+    template <class T, class Callback> StaticStream<T, Callback> makeStaticStream( Callback callback, int bufferSize, base::Time period, int priority = -1 )
+    {
+	return StaticStream<T, Callback>( callback, bufferSize, period, priority );
+    }
+
+    /** Stream aligner for a set of streams which is known at compile time.
+     *
+     * It plays out the samples in the same order, and with the same
+     * timeout handling, as StreamAligner. The streams are held in a
+     * std::tuple and addressed by their position, given as template
+     * argument, so that there is neither virtual dispatch nor type erasure
+     * of the callbacks, and the selection of the next stream gets unrolled
+     * at compile time.
+     *
+     * E.g.
+     *   auto aligner = makeStaticStreamAligner( base::Time::fromSeconds(1),
+     *	    makeStaticStream<Imu>( imu_callback, 100, base::Time::fromSeconds(0.01) ),
+     *	    makeStaticStream<Gps>( gps_callback, 4, base::Time::fromSeconds(1) ) );
+     *   aligner.push<0>( ts, imu );
+     *   while( aligner.step() );
+     */
+    template <class... Streams> class StaticStreamAligner
+    {
+    public:
+	typedef std::tuple<Streams...> stream_tuple;
+	static const size_t stream_count = sizeof...(Streams);
+
+    private:
+	stream_tuple streams;
+	base::Time timeout;
+
+	/** time of the last sample that came in */
+	base::Time latest_ts;
+
+	/** time of the last sample that went out */
+	base::Time current_ts;
+
+	size_t samples_dropped_late_arriving;
+
+	/** the stream a selection pass found first, along with its sort key */
+	struct Candidate
+	{
+	    size_t index;
+	    base::Time time;
+	    int priority;
+
+	    Candidate() : index( stream_count ), priority( 0 ) {}
+	    bool valid() const { return index < stream_count; }
+	};
+
+	/** unrolled passes over the streams */
+	template <size_t I, bool End = (I == stream_count)> struct Each
+	{
+	    /** find the stream with the oldest sample, and the earliest time
+	     * at which an empty active stream expects data */
+	    static void select( const stream_tuple &streams, Candidate &data, base::Time &wait )
+	    {
+		const typename std::tuple_element<I, stream_tuple>::type &stream( std::get<I>( streams ) );
+		if( stream.hasData() )
+		{
+		    const base::Time &ts( stream.buffer.front().first );
+		    if( !data.valid() || ts < data.time || (ts == data.time && stream.priority < data.priority) )
+		    {
+			data.index = I;
+			data.time = ts;
+			data.priority = stream.priority;
+		    }
+		}
+		else if( stream.active )
+		{
+		    const base::Time lookahead = stream.lastTime + stream.period;
+		    if( lookahead < wait )
+			wait = lookahead;
+		}
+		Each<I + 1>::select( streams, data, wait );
+	    }
+
+	    static base::Time pop( stream_tuple &streams, size_t index )
+	    {
+		if( index == I )
+		    return std::get<I>( streams ).pop();
+		return Each<I + 1>::pop( streams, index );
+	    }
+
+	    /** newest and oldest buffered data, for the initialization
+	     * case of the timeout */
+	    static void dataRange( const stream_tuple &streams, base::Time &latest, base::Time &first )
+	    {
+		const typename std::tuple_element<I, stream_tuple>::type &stream( std::get<I>( streams ) );
+		if( stream.hasData() )
+		{
+		    if( latest < stream.lastTime )
+			latest = stream.lastTime;
+		    if( first == base::Time() || first > stream.buffer.front().first )
+			first = stream.buffer.front().first;
+		}
+		Each<I + 1>::dataRange( streams, latest, first );
+	    }
+
+	    static void clear( stream_tuple &streams )
+	    {
+		std::get<I>( streams ).clear();
+		Each<I + 1>::clear( streams );
+	    }
+
+	    static void setupBuffers( stream_tuple &streams, const base::Time &timeout )
+	    {
+		std::get<I>( streams ).setupBuffer( timeout, 2.0 );
+		Each<I + 1>::setupBuffers( streams, timeout );
+	    }
+	};
+
+	template <size_t I> struct Each<I, true>
+	{
+	    static void select( const stream_tuple&, Candidate&, base::Time& ) {}
+	    static base::Time pop( stream_tuple&, size_t )
+	    {
+		throw std::runtime_error("pop() called on stream with no data.");
+	    }
+	    static void dataRange( const stream_tuple&, base::Time&, base::Time& ) {}
+	    static void clear( stream_tuple& ) {}
+	    static void setupBuffers( stream_tuple&, const base::Time& ) {}
+	};
+
+	bool isTimedOut() const
+	{
+	    base::Time latestDataTime;
+	    base::Time firstDataTime;
+
+	    //initalization case
+	    if( current_ts == base::Time() )
+		Each<0>::dataRange( streams, latestDataTime, firstDataTime );
+	    else
+	    {
+		latestDataTime = latest_ts;
+		firstDataTime = current_ts;
+	    }
+	    return !(latestDataTime - firstDataTime < timeout);
+	}
+
+    public:
+	/** @throws std::runtime_error if a stream has a negative buffer
+	 * size, but no period to compute it from */
+	explicit StaticStreamAligner( base::Time timeout, const Streams&... streams )
+	    : streams( streams... ), timeout( timeout ), samples_dropped_late_arriving( 0 ) 
+	{
+	    Each<0>::setupBuffers( this->streams, timeout );
+	}
+
+	/** @return the stream at position I */
+	template <size_t I> typename std::tuple_element<I, stream_tuple>::type &getStream()
+	{
+	    return std::get<I>( streams );
+	}
+
+	template <size_t I> const typename std::tuple_element<I, stream_tuple>::type &getStream() const
+	{
+	    return std::get<I>( streams );
+	}
+
+	/** @brief Push new data into stream I
+	 *
+	 * The sample is constructed from args. As with StreamAligner, this
+	 * enables a stream which has been disabled.
+	 */
+	template <size_t I, class... Args> void push( const base::Time &ts, Args&&... args )
+	{
+	    typename std::tuple_element<I, stream_tuple>::type &stream( std::get<I>( streams ) );
+	    stream.status.samples_received++;
+	    stream.status.latest_sample_time = ts;
+	    stream.active = true;
+
+	    //any sample, that is older than the last replayed sample
+	    //will never be played back and gets dropped by default
+	    if( ts < current_ts )
+	    {
+		samples_dropped_late_arriving++;
+		stream.status.samples_dropped_late_arriving++;
+		return;
+	    }
+
+	    if( ts > latest_ts )
+		latest_ts = ts;
+
+	    stream.push( ts, std::forward<Args>(args)... );
+	}
+
+	/** @see StreamAligner::disableStream */
+	template <size_t I> void disableStream() { std::get<I>( streams ).active = false; }
+
+	/** @see StreamAligner::enableStream */
+	template <size_t I> void enableStream() { std::get<I>( streams ).active = true; }
+
+	template <size_t I> bool isStreamActive() const { return std::get<I>( streams ).active; }
+
+	/** Plays out the oldest sample, with the same semantics as
+	 * StreamAligner::step()
+	 *
+	 *  @result - true if a callback was called and more data might be available
+	 */
+	bool step()
+	{
+	    Candidate data;
+	    base::Time wait = base::Time::fromMicroseconds( std::numeric_limits<int64_t>::max() );
+	    Each<0>::select( streams, data, wait );
+	    if( !data.valid() )
+		return false;
+
+	    // wait for an active stream expected to deliver older data,
+	    // unless the timeout has been reached
+	    if( wait < data.time && !isTimedOut() )
+		return false;
+
+	    current_ts = Each<0>::pop( streams, data.index );
+	    return true;
+	}
+
+	/** Plays out all the samples which can currently be released.
+	 *
+	 * @result the number of samples which have been played out and the
+	 *	resulting current time of the aligner
+	 */
+	std::pair<size_t, base::Time> drain()
+	{
+	    size_t count = 0;
+	    while( step() )
+		count++;
+	    return std::make_pair( count, current_ts );
+	}
+
+	/** clears all samples in all streams, resets the statistics and the
+	 * playback times */
+	void clear()
+	{
+	    Each<0>::clear( streams );
+	    latest_ts = base::Time();
+	    current_ts = base::Time();
+	    samples_dropped_late_arriving = 0;
+	}
+
+	void setTimeout( const base::Time &t ) { timeout = t; }
+	base::Time getTimeOut() const { return timeout; }
+
+	base::Time getLatency() const { return latest_ts - current_ts; }
+	base::Time getCurrentTime() const { return current_ts; }
+	base::Time getLatestTime() const { return latest_ts; }
+	size_t getSamplesDroppedLateArriving() const { return samples_dropped_late_arriving; }
+
+	template <size_t I> const StreamStatus &getBufferStatus() const
+	{
+	    return std::get<I>( streams ).getBufferStatus();
+	}
+    };
+
+    /** @return a StaticStreamAligner with the types of the streams
+     * deduced */
+    template <class... Streams> StaticStreamAligner<Streams...> makeStaticStreamAligner( base::Time timeout, const Streams&... streams )
+    {
+	return StaticStreamAligner<Streams...>( timeout, streams... );
+    }
+}
+
+#endif
@@ -5,33 +5,87 @@
 #include <cmath>
 #include <base-logging/Logging.hpp>
 #include <vector>
-#include <base/CircularBuffer.hpp>
 #include <algorithm>
+#include <limits>
+#include <utility>
+#include <type_traits>
+#include <tuple>
+#include <chrono>
+#include <atomic>
+#include <memory>
 #include <boost/function.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <stdexcept> 
+#include <typeinfo>
 #include <iostream>
 #include <aggregator/StreamAlignerStatus.hpp>
+#include <aggregator/ChunkedBuffer.hpp>
+#include <aggregator/SampleSize.hpp>
+#include <aggregator/Interpolation.hpp>
+#include <aggregator/IngestQueue.hpp>
+#include <aggregator/StreamTrace.hpp>
 
 namespace aggregator {
 
     class StreamAligner
     {
+	class StreamQueue;
+
 	class StreamBase
 	{
 	    friend class StreamAligner;
 	    public:
-		StreamBase() : active( true ) {}
+		StreamBase() : active( true ), buffer_bytes( 0 ), history_bytes( 0 ), reorder_samples( 0 ), index( -1 ), queue( 0 ), queue_pos( 0 ), queue_priority( 0 ), status_version( 0 ) {}
 		virtual ~StreamBase() {}
 		virtual base::Time pop() = 0;
+		/** remove the oldest sample without calling the callback
+		 * @return the time of the removed sample */
+		virtual base::Time discard() = 0;
+		/** remove the oldest sample once it has been handed out by
+		 * StreamAligner::next(), which counts as processing it
+		 * @param bytes - the footprint of the sample when it got handed
+		 *	out, as the consumer may have moved it out since
+		 * @return the time of the removed sample */
+		virtual base::Time consume( size_t bytes ) = 0;
+		/** @return a pointer to the oldest sample */
+		virtual void *frontSample() = 0;
+		/** @return the approximate footprint of the oldest sample */
+		virtual size_t frontBytes() const = 0;
+		virtual const std::type_info &getSampleType() const = 0;
 		virtual bool hasData() const = 0;
 		virtual int getPriority() const = 0;
 		virtual base::Time latestTimeStamp() const = 0;
 		virtual base::Time latestDataTime() const = 0;
 		virtual base::Time earliestDataTime() const = 0;
+		/** monotonic time at which the oldest buffered sample has been
+		 * pushed, null if unknown */
+		virtual base::Time earliestArrivalTime() const = 0;
+		/** time at which the sample following the last pushed one is
+		 * expected, i.e. the lookahead of the stream once it is empty */
+		virtual base::Time lookaheadTime() const = 0;
+		/** change the period used for the lookahead of the stream */
+		virtual void setPeriod( const base::Time &period ) = 0;
 		virtual const StreamStatus &getBufferStatus() const = 0;
+		const StreamLatencyStatus &getLatencyStatus() const { return latency; }
 		virtual void copyState( const StreamBase& other ) = 0;
 		virtual void clear() = 0;
+		/** move the samples pushed concurrently into the buffer, from the
+		 * consumer thread. @see StreamAligner::enableConcurrentIngest
+		 * @return the number of samples dropped by the producers since
+		 * the last call */
+		virtual size_t ingest( StreamAligner &aligner ) = 0;
+		/** remove the retained samples which are older than the
+		 * retention window before now */
+		virtual void trimHistory( const base::Time &now ) = 0;
+		/** position of the oldest retained sample. Positions count
+		 * all the samples ever retained, so that they stay valid
+		 * while older samples get removed */
+		virtual uint64_t getHistoryBegin() const = 0;
+		/** position following the newest retained sample */
+		virtual uint64_t getHistoryEnd() const = 0;
+		virtual base::Time getHistoryTime( uint64_t pos ) const = 0;
+		virtual const void *getHistorySample( uint64_t pos ) const = 0;
+		virtual bool hasMoveCallback() const = 0;
 
 		bool isActive() const { return active; }
 		void setActive( bool active ) { this->active = active; }
@@ -40,8 +94,151 @@ namespace aggregator {
 		
 	    protected:
 		mutable StreamStatus status;
+		StreamLatencyStatus latency;
 		/** marks a stream as active or inactive. All streams are active by default. */
 		bool active;
+		/** approximate memory footprint of the buffered samples, as given
+		 * by SampleSize */
+		size_t buffer_bytes;
+		/** approximate memory footprint of the retained samples */
+		size_t history_bytes;
+		/** maximum time samples of this stream wait for other streams.
+		 * Null to use the timeout of the stream aligner */
+		base::Time timeout;
+		/** window of data time during which the samples played out are
+		 * kept, null to keep none */
+		base::Time retention;
+		/** retention requested with setStreamRetention() */
+		base::Time lookup_retention;
+		/** maximum age, relative to the newest sample of the stream, of
+		 * the samples which get reordered. Null for no limit */
+		base::Time reorder_window;
+		/** maximum number of buffered samples an out of order sample
+		 * can be inserted before. 0 for no limit */
+		size_t reorder_samples;
+
+		/** @return true if samples received out of order get inserted
+		 * in the buffer instead of being dropped */
+		bool isReordering() const
+		{
+		    return !reorder_window.isNull() || reorder_samples;
+		}
+
+		/** index of the stream in the stream aligner, used to break ties
+		 * between streams of equal priority */
+		int index;
+		/** the queue the stream is currently scheduled in, or NULL */
+		StreamQueue *queue;
+		/** position of the stream inside the heap of its queue */
+		size_t queue_pos;
+		/** cached value of latestTimeStamp(), which is the key of the queue */
+		base::Time queue_time;
+		/** cached value of getPriority() */
+		int queue_priority;
+		/** changes whenever the state of the stream changes, so that
+		 * status copies only need to be updated for changed streams */
+		uint64_t status_version;
+	};
+
+	/** Indexed binary min-heap of streams.
+	 *
+	 * Streams are ordered by their cached next timestamp, then by priority
+	 * and finally by stream index. Each stream knows its position in the
+	 * heap, so that it can be moved in O(log N) whenever its next
+	 * timestamp changes, without having to sort all the streams again.
+	 */
+	class StreamQueue
+	{
+	    std::vector<StreamBase*> heap;
+
+	    static bool before( const StreamBase* s1, const StreamBase* s2 )
+	    {
+		if( s1->queue_time != s2->queue_time )
+		    return s1->queue_time < s2->queue_time;
+		if( s1->queue_priority != s2->queue_priority )
+		    return s1->queue_priority < s2->queue_priority;
+		return s1->index < s2->index;
+	    }
+
+	    void place( StreamBase* stream, size_t pos )
+	    {
+		heap[pos] = stream;
+		stream->queue_pos = pos;
+	    }
+
+	    void siftUp( size_t pos )
+	    {
+		StreamBase* stream = heap[pos];
+		while( pos > 0 )
+		{
+		    size_t parent = (pos - 1) / 2;
+		    if( !before( stream, heap[parent] ) )
+			break;
+		    place( heap[parent], pos );
+		    pos = parent;
+		}
+		place( stream, pos );
+	    }
+
+	    void siftDown( size_t pos )
+	    {
+		StreamBase* stream = heap[pos];
+		const size_t size = heap.size();
+		while( true )
+		{
+		    size_t child = 2 * pos + 1;
+		    if( child >= size )
+			break;
+		    if( child + 1 < size && before( heap[child + 1], heap[child] ) )
+			child++;
+		    if( !before( heap[child], stream ) )
+			break;
+		    place( heap[child], pos );
+		    pos = child;
+		}
+		place( stream, pos );
+	    }
+
+	public:
+	    bool empty() const { return heap.empty(); }
+	    size_t size() const { return heap.size(); }
+	    StreamBase* top() const { return heap.front(); }
+
+	    void insert( StreamBase* stream )
+	    {
+		stream->queue = this;
+		heap.push_back( stream );
+		siftUp( heap.size() - 1 );
+	    }
+
+	    void remove( StreamBase* stream )
+	    {
+		size_t pos = stream->queue_pos;
+		StreamBase* last = heap.back();
+		heap.pop_back();
+		stream->queue = 0;
+		if( last == stream )
+		    return;
+		place( last, pos );
+		update( last );
+	    }
+
+	    /** restore the heap property after the key of the stream changed */
+	    void update( StreamBase* stream )
+	    {
+		size_t pos = stream->queue_pos;
+		if( pos > 0 && before( stream, heap[(pos - 1) / 2] ) )
+		    siftUp( pos );
+		else
+		    siftDown( pos );
+	    }
+
+	    void clear()
+	    {
+		for(size_t i = 0; i < heap.size(); i++)
+		    heap[i]->queue = 0;
+		heap.clear();
+	    }
 	};
 
         public:
@@ -49,33 +246,58 @@ namespace aggregator {
 	{
 	public:
 	    typedef boost::function<void (const base::Time &ts, const T &value)> callback_t;
+	    /** callback which takes over the sample. If set, it is used instead of callback_t */
+	    typedef boost::function<void (const base::Time &ts, T &&value)> move_callback_t;
 
 	protected:
 	    typedef std::pair<base::Time,T> item;
-	    boost::circular_buffer<item> buffer;
+	    /** a buffered sample, along with the monotonic time at which it
+	     * got pushed */
+	    struct entry : public item
+	    {
+		base::Time arrival;
+
+		template <class... Args> entry( const base::Time &arrival, const base::Time &ts, Args&&... args )
+		    : item( std::piecewise_construct, std::forward_as_tuple( ts ), std::forward_as_tuple( std::forward<Args>(args)... ) ), 
+		    arrival( arrival ) {}
+	    };
+	    ChunkedBuffer<entry> buffer;
+	    /** samples which have been played out and are retained */
+	    ChunkedBuffer<item> history;
+	    /** position of the first sample of history */
+	    uint64_t history_begin;
+	    /** queue of the samples pushed from producer threads, NULL if the
+	     * stream is not in concurrent ingest mode */
+	    std::unique_ptr< IngestQueue<entry> > ingest_queue;
+	    /** number of samples producers dropped because the ingest queue
+	     * was full, not yet accounted for in the status */
+	    std::atomic<size_t> ingest_dropped;
 	    size_t bufferSize;
 	    callback_t callback;
+	    move_callback_t move_callback;
 	    base::Time period; 
 	    base::Time lastTime;
 	    int priority;
 
 	public:
-	    Stream( callback_t callback, size_t bufferSize, base::Time period, int priority, const std::string &name )
-		: bufferSize( bufferSize ), callback(callback), period(period), lastTime(base::Time::fromSeconds(0)), priority(priority)
+	    /** @param pool - the pool the chunks of the stream buffer are
+	     *		taken from. A bufferSize of 0 makes the buffer grow
+	     *		without limit. */
+	    Stream( callback_t callback, size_t bufferSize, base::Time period, int priority, const std::string &name, ChunkPool &pool )
+		: buffer( pool, bufferSize ), history( pool ), history_begin( 0 ), ingest_dropped( 0 ), bufferSize( bufferSize ), callback(callback), period(period), lastTime(base::Time::fromSeconds(0)), priority(priority)
             {
                 status.name = name;
 		status.priority = priority;
-
-                if (bufferSize > 0)
-                    buffer.set_capacity( bufferSize );
-                else
-                {
-                    // initial size, will be reallocated at runtime
-                    buffer.set_capacity( 20 );
-                }
-                status.buffer_size = buffer.capacity();
+                status.buffer_size = getBufferSize();
             }
 
+	    /** @return the size of the buffer, which for a dynamically sized
+	     * buffer is the capacity of its currently allocated chunks */
+	    size_t getBufferSize() const
+	    {
+		return bufferSize > 0 ? bufferSize : buffer.capacity();
+	    }
+
 	    virtual ~Stream() {};
 
 	    bool getNextSample(item &sample) const
@@ -87,14 +309,57 @@ namespace aggregator {
 		return true;
 	    }
 
+	    /** @return the number of samples which can be looked up, i.e. the
+	     * retained samples followed by the buffered ones */
+	    size_t getLookupSize() const
+	    {
+		return history.size() + buffer.size();
+	    }
+
+	    const item &getLookupSample( size_t i ) const
+	    {
+		if( i < history.size() )
+		    return history[i];
+		return buffer[i - history.size()];
+	    }
+
+	    /** @return the position of the first sample which is not older
+	     * than t, or getLookupSize() if there is none */
+	    size_t lookup( const base::Time &t ) const
+	    {
+		size_t begin = 0, end = getLookupSize();
+		while( begin < end )
+		{
+		    const size_t middle = begin + (end - begin) / 2;
+		    if( getLookupSample( middle ).first < t )
+			begin = middle + 1;
+		    else
+			end = middle;
+		}
+		return begin;
+	    }
+
 	    virtual int getPriority() const
 	    {
 		return priority;
 	    }
 
+	    base::Time getPeriod() const
+	    {
+		return period;
+	    }
+
+	    virtual void setPeriod( const base::Time &period )
+	    {
+		this->period = period;
+	    }
+
 	    virtual const StreamStatus &getBufferStatus() const
 	    {
 		status.buffer_fill = buffer.size();
+		status.buffer_size = getBufferSize();
+		status.buffer_bytes = buffer_bytes;
+		status.retained_bytes = history_bytes;
 		status.latest_data_time = latestDataTime();
  		status.earliest_data_time = earliestDataTime();
 		status.active = isActive();
@@ -107,35 +372,182 @@ namespace aggregator {
 		
 		lastTime = stream.lastTime;
 		buffer = stream.buffer;
+		history = stream.history;
+		history_begin = stream.history_begin;
 		bufferSize = stream.bufferSize;
+		buffer_bytes = stream.buffer_bytes;
+		history_bytes = stream.history_bytes;
 		status = stream.status; 
+		latency = stream.latency;
+	    }
+
+	    void setMoveCallback( move_callback_t callback )
+	    {
+		move_callback = callback;
 	    }
 
 	    void push(const base::Time &ts, const T &data ) 
 	    { 
+		emplace( ts, data );
+	    }
+
+	    void push(const base::Time &ts, T &&data ) 
+	    { 
+		emplace( ts, std::move(data) );
+	    }
+
+	    /** constructs the sample from args directly in the buffer */
+	    template <class... Args> void emplace(const base::Time &ts, Args&&... args ) 
+	    { 
+		receive( base::Time(), ts, std::forward<Args>(args)... );
+	    }
+
+	    /** outcome of receive() */
+	    enum ReceiveResult
+	    {
+		RECEIVED,
+		/** the sample got added, and the oldest sample dropped */
+		RECEIVED_BUFFER_FULL,
+		/** the sample is older than the previous one, and got dropped */
+		BACKWARD_IN_TIME,
+		/** the sample got reordered into a full buffer, but is older
+		 * than all buffered samples, and got dropped */
+		DROPPED_BUFFER_FULL
+	    };
+
+	    /** @return true if a sample older than the previous one is
+	     * within the reorder window of the stream */
+	    bool canReorder( const base::Time &ts ) const
+	    {
+		if( !isReordering() )
+		    return false;
+		if( !reorder_window.isNull() && lastTime - ts > reorder_window )
+		    return false;
+		if( reorder_samples )
+		{
+		    // count the samples to pass from the newest one
+		    size_t passed = 0;
+		    for(size_t i = buffer.size(); i > 0 && ts < buffer[i - 1].first; i--)
+		    {
+			if( ++passed > reorder_samples )
+			    return false;
+		    }
+		}
+		return true;
+	    }
+
+	    /** @overload which also records the time at which the sample
+	     * arrived, as given by StreamAligner::getMonotonicTime() */
+	    template <class... Args> ReceiveResult receive(const base::Time &arrival, const base::Time &ts, Args&&... args ) 
+	    { 
+		bool reordered = false;
 		if(ts < lastTime)
 		{
-		    status.samples_backward_in_time++;
-		    return;
+		    if( !canReorder( ts ) )
+		    {
+			status.samples_backward_in_time++;
+			return BACKWARD_IN_TIME;
+		    }
+		    reordered = true;
 		}
-		
-		lastTime = ts;
+		else
+		    lastTime = ts;
 
+		// only fixed size buffers get full. Dynamically sized buffers
+		// just link another chunk.
+		ReceiveResult result = RECEIVED;
 		if (buffer.full())
                 {
-		    if (bufferSize > 0)
-		    {
-		        // if the buffer is full, just use the behaviour of the circular
-		        // buffer: discard old data.
-		        status.samples_dropped_buffer_full++;
-		    }
-		    else
+		    // if the buffer is full, just use the behaviour of a circular
+		    // buffer: discard old data. A reordered sample may be the
+		    // oldest one.
+		    if( reordered && ts < buffer.front().first )
 		    {
-		        buffer.set_capacity(buffer.capacity() * 2);
-			status.buffer_size = buffer.capacity();
+			status.samples_dropped_buffer_full++;
+			return DROPPED_BUFFER_FULL;
 		    }
+		    removeFront();
+		    status.samples_dropped_buffer_full++;
+		    result = RECEIVED_BUFFER_FULL;
+		}
+                buffer.emplace_back( arrival, ts, std::forward<Args>(args)... ); 
+		buffer_bytes += sampleBytes( buffer.back() );
+
+		if( reordered )
+		{
+		    // move the sample to its place, after the samples with the
+		    // same time
+		    for(size_t i = buffer.size() - 1; i > 0 && ts < buffer[i - 1].first; i--)
+			std::swap( buffer[i - 1], buffer[i] );
+		    status.samples_reordered++;
+		}
+		return result;
+	    }
+
+	    /** hand a sample to the callback without buffering it
+	     *
+	     * @return false if the sample is older than the previous one, in
+	     *	which case it gets dropped
+	     */
+	    bool dispatch(const base::Time &ts, T &data )
+	    {
+		if(ts < lastTime)
+		{
+		    status.samples_backward_in_time++;
+		    return false;
 		}
-                buffer.push_back( std::make_pair(ts, data) ); 
+
+		lastTime = ts;
+		status.samples_processed++;
+		if(move_callback)
+		    move_callback( ts, std::move( data ) );
+		else if(callback)
+		    callback( ts, data );
+		return true;
+	    }
+
+	    /** create the queue through which producer threads push samples
+	     * into the stream */
+	    void setIngestQueueSize( size_t size )
+	    {
+		ingest_queue.reset( new IngestQueue<entry>( size ) );
+	    }
+
+	    /** @return true if samples are pushed through the ingest queue */
+	    bool isConcurrent() const
+	    {
+		return static_cast<bool>( ingest_queue );
+	    }
+
+	    /** queue a sample from a producer thread, to be ingested by the
+	     * consumer thread */
+	    template <class... Args> void enqueue(const base::Time &ts, Args&&... args ) 
+	    { 
+		if( !ingest_queue->push( StreamAligner::getMonotonicTime(), ts, std::forward<Args>(args)... ) )
+		    ingest_dropped.fetch_add( 1, std::memory_order_relaxed );
+	    }
+
+	    virtual size_t ingest( StreamAligner &aligner )
+	    {
+		size_t dropped = ingest_dropped.exchange( 0, std::memory_order_relaxed );
+		status.samples_received += dropped;
+		status.samples_dropped_ingest_full += dropped;
+
+		while( ingest_queue->pop( [this, &aligner]( entry &e ) 
+			    { aligner.receiveSample( this, e.arrival, e.first, std::move( e.second ) ); } ) );
+		return dropped;
+	    }
+
+	    /** approximate memory footprint of a buffered sample */
+	    static size_t sampleBytes( const item &sample )
+	    {
+		return sizeof(base::Time) + SampleSize<T>::get( sample.second );
+	    }
+
+	    void removeFront()
+	    {
+		buffer_bytes -= sampleBytes( buffer.front() );
+		buffer.pop_front();
 	    }
 
 	    /** take the last item of the stream queue and 
@@ -147,8 +559,21 @@ namespace aggregator {
 		{
 		    status.samples_processed++;
 		    base::Time ts = buffer.front().first;
-		    if(callback)
-			callback( ts, buffer.front().second );
+		    // the footprint has to be taken before the callback gets
+		    // the chance to move the sample
+		    buffer_bytes -= sampleBytes( buffer.front() );
+		    if(move_callback)
+			move_callback( ts, std::move( buffer.front().second ) );
+		    else
+		    {
+			if(callback)
+			    callback( ts, buffer.front().second );
+			if(!retention.isNull())
+			{
+			    history.emplace_back( ts, std::move( buffer.front().second ) );
+			    history_bytes += sampleBytes( history.back() );
+			}
+		    }
 		    buffer.pop_front();
 		    return ts;
 		}
@@ -156,6 +581,77 @@ namespace aggregator {
 		throw std::runtime_error("pop() called on stream with no data.");
 	    }
 
+	    base::Time discard()
+	    {
+		if( hasData() )
+		{
+		    base::Time ts = buffer.front().first;
+		    removeFront();
+		    return ts;
+		}
+
+		throw std::runtime_error("discard() called on stream with no data.");
+	    }
+
+	    base::Time consume( size_t bytes )
+	    {
+		status.samples_processed++;
+		base::Time ts = buffer.front().first;
+		buffer_bytes -= bytes;
+		buffer.pop_front();
+		return ts;
+	    }
+
+	    virtual void *frontSample()
+	    {
+		return &buffer.front().second;
+	    }
+
+	    virtual size_t frontBytes() const
+	    {
+		return sampleBytes( buffer.front() );
+	    }
+
+	    virtual const std::type_info &getSampleType() const
+	    {
+		return typeid(T);
+	    }
+
+	    virtual void trimHistory( const base::Time &now )
+	    {
+		while( !history.empty() && (retention.isNull() || history.front().first < now - retention) )
+		{
+		    history_bytes -= sampleBytes( history.front() );
+		    history.pop_front();
+		    history_begin++;
+		}
+	    }
+
+	    virtual uint64_t getHistoryBegin() const
+	    {
+		return history_begin;
+	    }
+
+	    virtual uint64_t getHistoryEnd() const
+	    {
+		return history_begin + history.size();
+	    }
+
+	    virtual base::Time getHistoryTime( uint64_t pos ) const
+	    {
+		return history[pos - history_begin].first;
+	    }
+
+	    virtual const void *getHistorySample( uint64_t pos ) const
+	    {
+		return &history[pos - history_begin].second;
+	    }
+
+	    virtual bool hasMoveCallback() const
+	    {
+		return static_cast<bool>( move_callback );
+	    }
+
 	    bool hasData() const
 	    { return !buffer.empty(); }
 
@@ -178,50 +674,142 @@ namespace aggregator {
 		    return buffer.front().first;
 		return base::Time();
 	    }
+
+	    virtual base::Time lookaheadTime() const
+	    {
+		return lastTime + period;
+	    }
+
+	    virtual base::Time earliestArrivalTime() const
+	    {
+		if( hasData() )
+		    return buffer.front().arrival;
+		return base::Time();
+	    }
 	    
 	    virtual void clear()
 	    {	
 		lastTime = base::Time();
 		buffer.clear();
+		buffer_bytes = 0;
+		// samples queued by producers before the clear are discarded
+		if( ingest_queue )
+		{
+		    while( ingest_queue->pop( []( entry& ) {} ) );
+		    ingest_dropped.store( 0, std::memory_order_relaxed );
+		}
+		history_begin += history.size();
+		history.clear();
+		history_bytes = 0;
 		
 		status.latest_sample_time = base::Time();
 		status.latest_data_time = base::Time();
 		status.samples_dropped_buffer_full = 0;
 		status.samples_dropped_late_arriving = 0;
+		status.samples_dropped_ingest_full = 0;
+		latency.clear();
 		status.buffer_fill = 0;
 		status.active = true;
 	    };
 	};
 
-	static bool compareStreams( const StreamBase* b1, const StreamBase* b2 )
+	/** policies of sampleAt() */
+	enum LookupPolicy
 	{
-	    if(!b1)
-		return false;
-	    
-	    if(!b2)
-		return true;
-	    
-	    const base::Time &ts1( b1->latestTimeStamp() );
-	    const base::Time &ts2( b2->latestTimeStamp() );
+	    LOOKUP_NEAREST,
+	    LOOKUP_BEFORE,
+	    LOOKUP_AFTER
+	};
+
+	/** Typed reference to a stream, as returned by registerStream().
+	 *
+	 * Pushing through a handle goes directly to the stream, without the
+	 * index lookup and the dynamic_cast of the index based calls. The
+	 * handle converts implicitly to the stream index, so it can be used
+	 * wherever an index is expected.
+	 *
+	 * A handle becomes invalid when its stream gets unregistered. This is
+	 * checked by assertions in debug builds, and can be queried with
+	 * isValid().
+	 */
+	template <class T> class StreamHandle
+	{
+	    friend class StreamAligner;
+
+	    StreamAligner *aligner;
+	    Stream<T> *stream;
+	    int idx;
+	    unsigned generation;
+
+	    StreamHandle( StreamAligner *aligner, Stream<T> *stream, int idx, unsigned generation )
+		: aligner( aligner ), stream( stream ), idx( idx ), generation( generation ) {}
+
+	public:
+	    StreamHandle() : aligner( 0 ), stream( 0 ), idx( -1 ), generation( 0 ) {}
+
+	    operator int() const { return idx; }
+
+	    /** @return the index of the stream in the stream aligner */
+	    int getIndex() const { return idx; }
 
-	    if(ts1 == ts2)
+	    /** @return true if the stream this handle refers to is still
+	     * registered */
+	    bool isValid() const
 	    {
-		if(b1->hasData() && !b2->hasData())
-		    return true;
-		
-		if(!b1->hasData() && b2->hasData())
-		    return false;
-		
-		return b1->getPriority() < b2->getPriority();
+		return aligner && aligner->isValid( *this );
 	    }
-	    
-	    return ts1 < ts2;
-	}
+
+	    /** @see StreamAligner::push */
+	    void push( const base::Time &ts, const T& data )
+	    {
+		aligner->push( *this, ts, data );
+	    }
+
+	    void push( const base::Time &ts, T&& data )
+	    {
+		aligner->push( *this, ts, std::move(data) );
+	    }
+
+	    /** @see StreamAligner::emplace */
+	    template <class... Args> void emplace( const base::Time &ts, Args&&... args )
+	    {
+		aligner->emplace( *this, ts, std::forward<Args>(args)... );
+	    }
+
+	    /** @see StreamAligner::getNextSample */
+	    bool getNextSample( std::pair<base::Time,T> &sample ) const
+	    {
+		return aligner->getNextSample( *this, sample );
+	    }
+
+	    /** @see StreamAligner::sampleAt */
+	    const std::pair<base::Time,T> *sampleAt( const base::Time &t, LookupPolicy policy = LOOKUP_NEAREST ) const
+	    {
+		return aligner->sampleAt( *this, t, policy );
+	    }
+
+	    /** @see StreamAligner::interpolateAt */
+	    bool interpolateAt( const base::Time &t, T &result ) const
+	    {
+		return aligner->interpolateAt( *this, t, result );
+	    }
+	};
+
+	/** pool of the memory chunks of the stream buffers */
+	ChunkPool pool;
 
 	typedef std::vector<StreamBase*> stream_vector;
 	stream_vector streams;
+	/** incremented each time a stream slot is freed, in order to detect
+	 * handles to unregistered streams */
+	std::vector<unsigned> generations;
 	base::Time timeout;
 
+	/** streams which have data, ordered by the time of their oldest sample */
+	StreamQueue data_queue;
+	/** active streams without data, ordered by their lookahead time */
+	StreamQueue wait_queue;
+
 	/** time of the last sample that came in */
 	base::Time latest_ts;
 
@@ -230,28 +818,766 @@ namespace aggregator {
 
 	double buffer_size_factor;
 
-	/** temporary object that gets returned by getStatus, 
-	 * in order to avoid dynamic allocation on each call
-	 */  
-	mutable StreamAlignerStatus status;
-
     public:
-	explicit StreamAligner(base::Time timeout = base::Time::fromSeconds(1))
-	    : timeout(timeout), buffer_size_factor(2.0) {}
-
-	virtual ~StreamAligner()
+	/** Policy for giving the memory of the stream buffers back to the
+	 * system once a burst is over.
+	 *
+	 * The buffers return their drained chunks to a pool shared by all
+	 * streams, which keeps them for reuse. Once less than low_watermark
+	 * of the memory held by the pool has been in use for at least
+	 * window (in data time), the unused chunks are freed, until the
+	 * memory in use is again low_watermark of the memory held. 
+	 *
+	 * As the window is measured in data time, the policy is only applied
+	 * while samples are played out, and nothing gets freed while the
+	 * aligner is idle. Use trimMemory() to free the unused chunks at that
+	 * point.
+	 *
+	 * A low_watermark of 0 disables shrinking, which is the default.
+	 * Otherwise it has to be below 1.
+	 */
+	struct ShrinkPolicy
 	{
-	    for(stream_vector::iterator it=streams.begin();it != streams.end();it++)
-		delete *it;
-	}
+	    double low_watermark;
+	    base::Time window;
 
-	/** will take the state of other StreamAligner and make it the state of this 
-	 * object. State constitutes current_time and latest_time as well as all the stream
-	 * content, but not the configuration.
+	    ShrinkPolicy() : low_watermark( 0 ) {}
+	    ShrinkPolicy( double low_watermark, const base::Time &window )
+		: low_watermark( low_watermark ), window( window ) {}
+	};
+
+	/** What to do when pushing a sample brings the memory footprint of
+	 * all buffered samples above the memory budget
 	 */
-	void copyState(const StreamAligner& other)
+	enum MemoryBudgetPolicy
 	{
-	    latest_ts = other.latest_ts;
+	    /** drop the oldest buffered sample of all streams */
+	    DROP_OLDEST,
+	    /** drop the oldest sample of the stream with the highest
+	     * priority value (i.e. the one processed last on equal times) */
+	    DROP_LOWEST_PRIORITY,
+	    /** play out the oldest buffered sample, without waiting for the
+	     * streams which might deliver older data, as if the timeout had
+	     * been reached */
+	    FORCE_TIMEOUT
+	};
+
+	/** The samples matched by a synchronizer, one per stream, in the
+	 * order of the streams given to addSynchronizer(). The samples are
+	 * the ones retained in the stream buffers, and are only valid during
+	 * the callback of the synchronizer.
+	 */
+	class MatchedSamples
+	{
+	    friend class StreamAligner;
+
+	    struct Match
+	    {
+		int stream_index;
+		base::Time time;
+		const void *sample;
+		const std::type_info *type;
+	    };
+	    std::vector<Match> matches;
+
+	public:
+	    size_t size() const { return matches.size(); }
+
+	    int getStreamIndex( size_t i ) const { return matches.at(i).stream_index; }
+
+	    base::Time getTime( size_t i ) const { return matches.at(i).time; }
+
+	    template <class T> bool is( size_t i ) const
+	    {
+		return *matches.at(i).type == typeid(T);
+	    }
+
+	    /** @throws std::bad_cast if the sample is not of type T */
+	    template <class T> const T &get( size_t i ) const
+	    {
+		if( !is<T>( i ) )
+		    throw std::bad_cast();
+		return *static_cast<const T*>( matches[i].sample );
+	    }
+	};
+
+	/** callback of a synchronizer, which gets the time of the reference
+	 * sample and the matched samples */
+	typedef boost::function<void (const base::Time &ts, const MatchedSamples &samples)> sync_callback_t;
+
+	struct SynchronizerStatus
+	{
+	    /** number of reference samples for which a match was emitted */
+	    size_t matched;
+	    /** number of reference samples without a sample within the
+	     * maximum skew on one of the other streams */
+	    size_t unmatched;
+
+	    SynchronizerStatus() : matched( 0 ), unmatched( 0 ) {}
+	};
+
+    private:
+	/** maximum wall clock time a sample waits in the aligner, null for none */
+	base::Time wall_timeout;
+
+	/** if true, the residency time and release lag of the samples are
+	 * recorded in the stream status */
+	bool latency_statistics;
+
+	/** recorder of the pushes and releases, or NULL */
+	StreamTrace *trace;
+
+	/** maximum footprint of all buffered samples in bytes, 0 for none */
+	size_t memory_budget;
+	MemoryBudgetPolicy memory_budget_policy;
+	/** approximate footprint of all buffered samples */
+	size_t buffered_bytes;
+
+	/** stream whose oldest sample has been handed out by next(), and
+	 * still has to be removed */
+	StreamBase *pending;
+	/** footprint of the pending sample when it got handed out */
+	size_t pending_bytes;
+
+	/** matches the samples of a reference stream with the closest
+	 * samples of other streams. @see addSynchronizer */
+	struct Synchronizer
+	{
+	    /** the streams, starting with the reference. Empty once the
+	     * synchronizer has been removed */
+	    stream_vector streams;
+	    /** per stream, the position of the next reference sample or of
+	     * the first candidate sample in the stream history */
+	    std::vector<uint64_t> cursors;
+	    base::Time max_skew;
+	    sync_callback_t callback;
+	    MatchedSamples samples;
+	    SynchronizerStatus status;
+	};
+	std::vector<Synchronizer> synchronizers;
+	/** number of synchronizers which have not been removed */
+	size_t synchronizer_count;
+
+	/** streams in concurrent ingest mode */
+	stream_vector ingest_streams;
+	/** set by producer threads after queueing samples, cleared by
+	 * ingest() */
+	std::atomic<bool> ingest_pending;
+
+	ShrinkPolicy shrink_policy;
+	/** data time since which the pool usage is below the low watermark,
+	 * or null if it is not */
+	base::Time shrink_low_since;
+
+	/** temporary object that gets returned by getStatus, 
+	 * in order to avoid dynamic allocation on each call
+	 */  
+	mutable StreamAlignerStatus status;
+
+	/** last value given to StreamBase::status_version */
+	uint64_t status_version;
+
+	/** a copy of the status, along with the version and the generation
+	 * of each stream at the time it got copied */
+	struct StatusCopy
+	{
+	    StreamAlignerStatus status;
+	    std::vector<uint64_t> versions;
+	    std::vector<unsigned> generations;
+	};
+
+	/** versions of the streams in status, for getStatus() */
+	mutable std::vector<uint64_t> status_versions;
+	mutable std::vector<unsigned> status_generations;
+
+	/** triple buffer of status snapshots for monitoring threads. The
+	 * back buffer is written by publishStatus(), the front buffer is
+	 * read after readStatus(), and the middle one is exchanged between
+	 * both. */
+	StatusCopy snapshots[3];
+	int snapshot_back;
+	int snapshot_front;
+	/** index of the middle buffer, or'ed with SNAPSHOT_FRESH if it has
+	 * been published since the last readStatus() */
+	std::atomic<int> snapshot_middle;
+	static const int SNAPSHOT_FRESH = 4;
+	static const int SNAPSHOT_INDEX = 3;
+
+	/** Bring the given status up to date. Only the streams which changed
+	 * since the last update of that status are copied, and the names
+	 * only for streams which have not been copied before. */
+	void updateStatus( StreamAlignerStatus &dst, std::vector<uint64_t> &versions, std::vector<unsigned> &copied_generations ) const
+	{
+	    dst.time = base::Time::now();
+	    dst.current_time = getCurrentTime();
+	    dst.latest_time = getLatestTime();
+	    dst.samples_dropped_late_arriving = status.samples_dropped_late_arriving;
+	    dst.samples_dropped_memory_budget = status.samples_dropped_memory_budget;
+	    dst.samples_released_memory_budget = status.samples_released_memory_budget;
+	    dst.buffer_bytes_allocated = pool.getAllocatedBytes();
+	    dst.buffer_bytes_reclaimed = pool.getReclaimedBytes();
+	    dst.buffered_bytes = buffered_bytes;
+	    dst.retained_bytes = getRetainedBytes();
+
+	    dst.streams.resize( streams.size() );
+	    versions.resize( streams.size(), 0 );
+	    copied_generations.resize( streams.size(), 0 );
+	    for(size_t i=0;i<streams.size();i++)
+	    {
+		const bool same_stream = copied_generations[i] == generations[i] && versions[i] != 0;
+		if( !streams[i] )
+		{
+		    dst.streams[i].active = false;
+		    versions[i] = 0;
+		}
+		else if( !same_stream )
+		    dst.streams[i] = streams[i]->getBufferStatus();
+		else if( versions[i] != streams[i]->status_version )
+		    dst.streams[i].copyWithoutName( streams[i]->getBufferStatus() );
+
+		if( streams[i] )
+		    versions[i] = streams[i]->status_version;
+		copied_generations[i] = generations[i];
+	    }
+	}
+
+	template <class T, class... Args> void pushSample( Stream<T>* stream, const base::Time &ts, Args&&... args )
+	{
+	    if( stream->isConcurrent() )
+	    {
+		stream->enqueue( ts, std::forward<Args>(args)... );
+		ingest_pending.store( true, std::memory_order_release );
+		return;
+	    }
+
+	    receiveSample( stream, wall_timeout.isNull() && !latency_statistics && !trace ? base::Time() : getMonotonicTime(), 
+		    ts, std::forward<Args>(args)... );
+	}
+
+	/** add a sample to the buffer of a stream, and update the queues
+	 * accordingly. 
+	 *
+	 * @param arrival - the monotonic time at which the sample got pushed,
+	 *	or null if unknown
+	 */
+	template <class T, class... Args> void receiveSample( Stream<T>* stream, const base::Time &arrival, const base::Time &ts, Args&&... args )
+	{
+	    finishPending();
+	    stream->status.samples_received++;
+	    if( ts > stream->status.latest_sample_time )
+		stream->status.latest_sample_time = ts;
+
+	    // mark stream as active, since it is receiving data items will
+	    // have no effect on an already active stream, but enables
+	    // streams which have been marked passive before.
+	    stream->setActive( true );
+
+	    //any sample, that is older than the last replayed sample
+	    //will never be played back and gets dropped by default
+	    if(ts < current_ts) 
+	    {
+		status.samples_dropped_late_arriving++;
+		stream->status.samples_dropped_late_arriving++;
+		if( trace )
+		    trace->record( TRACE_DROPPED_LATE, stream->index, ts, arrival );
+		updateQueue( stream, stream->Stream<T>::hasData(), stream->Stream<T>::latestTimeStamp() );
+		return;
+	    }
+
+	    if( ts > latest_ts )
+		latest_ts = ts;
+	    
+	    const size_t bytes = stream->buffer_bytes;
+	    if( trace )
+	    {
+		// the oldest sample is the one dropped on a full buffer
+		const base::Time oldest = stream->Stream<T>::earliestDataTime();
+		switch( stream->receive( arrival, ts, std::forward<Args>(args)... ) )
+		{
+		    case Stream<T>::BACKWARD_IN_TIME:
+			trace->record( TRACE_DROPPED_BACKWARD, stream->index, ts, arrival );
+			break;
+		    case Stream<T>::DROPPED_BUFFER_FULL:
+			trace->record( TRACE_DROPPED_BUFFER_FULL, stream->index, ts, arrival );
+			break;
+		    case Stream<T>::RECEIVED_BUFFER_FULL:
+			trace->record( TRACE_DROPPED_BUFFER_FULL, stream->index, oldest, arrival );
+			// fall through
+		    case Stream<T>::RECEIVED:
+			trace->record( TRACE_PUSH, stream->index, ts, arrival );
+			break;
+		}
+	    }
+	    else
+		stream->receive( arrival, ts, std::forward<Args>(args)... );
+	    buffered_bytes += stream->buffer_bytes - bytes;
+	    updateQueue( stream, stream->Stream<T>::hasData(), stream->Stream<T>::latestTimeStamp() );
+
+	    if( memory_budget && buffered_bytes > memory_budget )
+		enforceMemoryBudget();
+	}
+
+	/** record the residency time and release lag of the oldest sample
+	 * of the stream, which is about to be released */
+	void recordLatency( StreamBase *stream )
+	{
+	    const base::Time arrival = stream->earliestArrivalTime();
+	    if( !arrival.isNull() )
+		stream->latency.residency_time.add( getMonotonicTime() - arrival );
+	    stream->latency.release_lag.add( latest_ts - stream->earliestDataTime() );
+	}
+
+	/** play out the oldest sample of the given stream */
+	void release( StreamBase *stream, TraceEvent event = TRACE_RELEASE )
+	{
+	    if( latency_statistics )
+		recordLatency( stream );
+	    if( trace )
+		trace->record( event, stream->index, stream->earliestDataTime(), getMonotonicTime() );
+	    const size_t bytes = stream->buffer_bytes;
+	    current_ts = stream->pop();
+	    buffered_bytes -= bytes - stream->buffer_bytes;
+	    updateQueue( stream );
+
+	    if( synchronizer_count )
+	    {
+		for(size_t i = 0; i < synchronizers.size(); i++)
+		{
+		    if( !synchronizers[i].streams.empty() )
+			synchronize( synchronizers[i] );
+		}
+	    }
+	    if( !stream->retention.isNull() )
+		stream->trimHistory( current_ts );
+	}
+
+	/** outcome of findMatch() */
+	enum MatchResult
+	{
+	    MATCHED,
+	    NO_MATCH,
+	    /** the closest sample is not known yet */
+	    MATCH_PENDING
+	};
+
+	static base::Time timeDistance( const base::Time &a, const base::Time &b )
+	{
+	    return a < b ? b - a : a - b;
+	}
+
+	/** move the cursor of a stream of a synchronizer to the retained
+	 * sample which is the closest to the reference time t. Samples
+	 * older than t - max_skew are passed over, as they cannot match
+	 * later reference samples either. */
+	MatchResult findMatch( Synchronizer &sync, size_t i, const base::Time &t ) const
+	{
+	    const StreamBase *stream = sync.streams[i];
+	    uint64_t &pos( sync.cursors[i] );
+	    pos = std::max( pos, stream->getHistoryBegin() );
+	    const uint64_t end = stream->getHistoryEnd();
+	    while( pos < end && stream->getHistoryTime( pos ) < t - sync.max_skew )
+		pos++;
+
+	    // the samples played out later are not older than current_ts
+	    if( pos == end )
+		return current_ts - t > sync.max_skew ? NO_MATCH : MATCH_PENDING;
+
+	    // samples of equal time are skipped, so that the first of them is
+	    // matched, and last is the last of them
+	    base::Time distance = timeDistance( stream->getHistoryTime( pos ), t );
+	    uint64_t last = pos;
+	    while( last + 1 < end )
+	    {
+		const base::Time next_time = stream->getHistoryTime( last + 1 );
+		if( next_time == stream->getHistoryTime( pos ) )
+		{
+		    last++;
+		    continue;
+		}
+		// on a tie, the earlier sample is kept
+		const base::Time next = timeDistance( next_time, t );
+		if( !(next < distance) )
+		    break;
+		distance = next;
+		pos = last = last + 1;
+	    }
+
+	    if( distance > sync.max_skew )
+		return NO_MATCH;
+	    if( last + 1 < end || !(stream->getHistoryTime( pos ) < t) )
+		return MATCHED;
+	    return current_ts - t < distance ? MATCH_PENDING : MATCHED;
+	}
+
+	/** emit the matches of all the reference samples for which the
+	 * closest samples of the other streams are known */
+	void synchronize( Synchronizer &sync )
+	{
+	    StreamBase *reference = sync.streams[0];
+	    uint64_t &pos( sync.cursors[0] );
+	    pos = std::max( pos, reference->getHistoryBegin() );
+	    while( pos < reference->getHistoryEnd() )
+	    {
+		const base::Time t = reference->getHistoryTime( pos );
+		bool matched = true;
+		for(size_t i = 1; i < sync.streams.size(); i++)
+		{
+		    MatchResult result = findMatch( sync, i, t );
+		    if( result == MATCH_PENDING )
+			return;
+		    if( result == NO_MATCH )
+			matched = false;
+		}
+
+		if( matched )
+		{
+		    for(size_t i = 0; i < sync.streams.size(); i++)
+		    {
+			MatchedSamples::Match &match( sync.samples.matches[i] );
+			match.time = sync.streams[i]->getHistoryTime( sync.cursors[i] );
+			match.sample = sync.streams[i]->getHistorySample( sync.cursors[i] );
+		    }
+		    sync.status.matched++;
+		    sync.callback( t, sync.samples );
+		}
+		else
+		    sync.status.unmatched++;
+		pos++;
+	    }
+	}
+
+	/** set the retention window of all streams to what their
+	 * synchronizers need */
+	void updateRetention()
+	{
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if( streams[i] )
+		    streams[i]->retention = streams[i]->lookup_retention;
+	    }
+	    for(size_t i = 0; i < synchronizers.size(); i++)
+	    {
+		const Synchronizer &sync( synchronizers[i] );
+		for(size_t j = 0; j < sync.streams.size(); j++)
+		    sync.streams[j]->retention = std::max( sync.streams[j]->retention, sync.max_skew * 2 );
+	    }
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if( streams[i] )
+		{
+		    streams[i]->trimHistory( current_ts );
+		    streams[i]->status_version = ++status_version;
+		}
+	    }
+	}
+
+	template <class T> static const std::pair<base::Time,T> *sampleAt( const Stream<T> *stream, const base::Time &t, LookupPolicy policy )
+	{
+	    const size_t size = stream->getLookupSize();
+	    size_t pos = stream->lookup( t );
+	    if( policy == LOOKUP_BEFORE )
+	    {
+		if( pos == size || stream->getLookupSample( pos ).first != t )
+		{
+		    if( pos == 0 )
+			return 0;
+		    pos--;
+		}
+	    }
+	    else if( policy == LOOKUP_NEAREST )
+	    {
+		if( pos == size && pos == 0 )
+		    return 0;
+		if( pos == size || (pos > 0 && !(timeDistance( stream->getLookupSample( pos - 1 ).first, t ) > timeDistance( stream->getLookupSample( pos ).first, t ))) )
+		    pos--;
+	    }
+	    else if( pos == size )
+		return 0;
+	    return &stream->getLookupSample( pos );
+	}
+
+	template <class T> static bool bracketAt( const Stream<T> *stream, const base::Time &t, const std::pair<base::Time,T> *&before, const std::pair<base::Time,T> *&after )
+	{
+	    const size_t pos = stream->lookup( t );
+	    if( pos == stream->getLookupSize() )
+		return false;
+	    after = &stream->getLookupSample( pos );
+	    if( after->first == t )
+		before = after;
+	    else if( pos == 0 )
+		return false;
+	    else
+		before = &stream->getLookupSample( pos - 1 );
+	    return true;
+	}
+
+	template <class T, class F> static bool interpolateAt( const Stream<T> *stream, const base::Time &t, T &result, F interpolate )
+	{
+	    const std::pair<base::Time,T> *before, *after;
+	    if( !bracketAt( stream, t, before, after ) )
+		return false;
+	    if( before == after )
+		result = before->second;
+	    else
+		interpolate( t, *before, *after, result );
+	    return true;
+	}
+
+	/** restart all synchronizers at the newest retained samples */
+	void resetSynchronizers()
+	{
+	    for(size_t i = 0; i < synchronizers.size(); i++)
+	    {
+		Synchronizer &sync( synchronizers[i] );
+		for(size_t j = 0; j < sync.streams.size(); j++)
+		    sync.cursors[j] = sync.streams[j]->getHistoryEnd();
+	    }
+	}
+
+	/** remove the sample handed out by the last call to next() */
+	void finishPending()
+	{
+	    if( !pending )
+		return;
+
+	    StreamBase *stream = pending;
+	    pending = 0;
+	    stream->consume( pending_bytes );
+	    buffered_bytes -= pending_bytes;
+	    updateQueue( stream );
+	    updateShrink();
+	}
+
+	/** apply the memory budget policy until the buffered samples fit
+	 * into the budget again */
+	void enforceMemoryBudget()
+	{
+	    while( buffered_bytes > memory_budget && !data_queue.empty() )
+	    {
+		StreamBase *stream = data_queue.top();
+		if( memory_budget_policy == FORCE_TIMEOUT )
+		{
+		    status.samples_released_memory_budget++;
+		    stream->status.samples_released_memory_budget++;
+		    release( stream, TRACE_RELEASE_MEMORY_BUDGET );
+		    continue;
+		}
+
+		if( memory_budget_policy == DROP_LOWEST_PRIORITY )
+		{
+		    for(stream_vector::const_iterator it=streams.begin();it != streams.end();it++)
+		    {
+			if( *it && (*it)->queue == &data_queue && (*it)->queue_priority >= stream->queue_priority )
+			    stream = *it;
+		    }
+		}
+
+		status.samples_dropped_memory_budget++;
+		stream->status.samples_dropped_memory_budget++;
+		if( trace )
+		    trace->record( TRACE_DROPPED_MEMORY_BUDGET, stream->index, stream->earliestDataTime(), getMonotonicTime() );
+		const size_t bytes = stream->buffer_bytes;
+		stream->discard();
+		buffered_bytes -= bytes - stream->buffer_bytes;
+		updateQueue( stream );
+	    }
+	}
+
+	template <class T> Stream<T>* getStream( int idx ) const
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    Stream<T>* stream = dynamic_cast<Stream<T>*>(streams[idx]);
+	    assert( stream );
+	    return stream;
+	}
+
+	/** Move the stream into the queue matching its current state, and
+	 * update its position there. This has to be called whenever the
+	 * next timestamp, the data availability or the active flag of a
+	 * stream changes.
+	 */
+	void updateQueue( StreamBase* stream )
+	{
+	    updateQueue( stream, stream->hasData(), stream->latestTimeStamp() );
+	}
+
+	/** @overload for callers which know the state of the stream without
+	 * going through the virtual interface */
+	void updateQueue( StreamBase* stream, bool hasData, const base::Time &ts )
+	{
+	    stream->status_version = ++status_version;
+
+	    StreamQueue *target = 0;
+	    if( hasData )
+		target = &data_queue;
+	    else if( stream->isActive() )
+		target = &wait_queue;
+
+	    if( stream->queue != target )
+	    {
+		if( stream->queue )
+		    stream->queue->remove( stream );
+		if( target )
+		{
+		    stream->queue_time = ts;
+		    target->insert( stream );
+		}
+	    }
+	    else if( target )
+	    {
+		if( ts != stream->queue_time )
+		{
+		    stream->queue_time = ts;
+		    target->update( stream );
+		}
+	    }
+	}
+
+	/** @return true if the stream with the oldest sample has to wait for
+	 * an active stream which is expected to deliver older data
+	 */
+	bool isBlocked() const
+	{
+	    if( wait_queue.empty() || !(wait_queue.top()->queue_time < data_queue.top()->queue_time) )
+		return false;
+	    if( isTimedOut( data_queue.top() ) )
+		return false;
+	    return !isWallClockTimedOut();
+	}
+
+	/** @return true if the oldest sample has been waiting for longer than
+	 * the wall clock timeout
+	 */
+	bool isWallClockTimedOut() const
+	{
+	    if( wall_timeout.isNull() )
+		return false;
+
+	    base::Time arrival = data_queue.top()->earliestArrivalTime();
+	    return !arrival.isNull() && !(getMonotonicTime() - arrival < wall_timeout);
+	}
+
+	/** The time up to which samples can be played out without looking at
+	 * the timeout. No active stream will deliver data before that time,
+	 * even after all the data buffered up to it has been played out.
+	 */
+	base::Time getReleaseHorizon() const
+	{
+	    base::Time horizon = base::Time::fromMicroseconds( std::numeric_limits<int64_t>::max() );
+	    if( !wait_queue.empty() )
+		horizon = wait_queue.top()->queue_time;
+
+	    for(stream_vector::const_iterator it=streams.begin();it != streams.end();it++)
+	    {
+		if( *it && (*it)->queue == &data_queue && (*it)->isActive() )
+		    horizon = std::min( horizon, (*it)->lookaheadTime() );
+	    }
+	    return horizon;
+	}
+
+	/** rebuild both queues from the state of all the streams */
+	void rebuildQueues()
+	{
+	    data_queue.clear();
+	    wait_queue.clear();
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if(streams[i])
+		    updateQueue( streams[i] );
+	    }
+	}
+
+	/** Get the time of the newest data and the time from which the
+	 * timeout is counted. The aligner has timed out once their difference
+	 * reaches the timeout.
+	 */
+	void getTimeoutReference( base::Time &latestDataTime, base::Time &firstDataTime ) const
+	{
+	    //initalization case
+	    if(current_ts == base::Time())
+	    {
+		for(stream_vector::const_iterator it=streams.begin();it != streams.end();it++)
+		{
+		    if(*it && (*it)->hasData())
+		    {
+			if(latestDataTime < (*it)->latestDataTime())
+			    latestDataTime = (*it)->latestDataTime();
+
+			if(firstDataTime == base::Time() || firstDataTime > (*it)->earliestDataTime())
+			    firstDataTime = (*it)->earliestDataTime();
+		    }
+		}
+	    } else {
+		latestDataTime = latest_ts;
+		firstDataTime = current_ts;
+	    }
+	}
+
+	/** @return true if the time the oldest sample, which is on the given
+	 * stream, waits for missing data on other streams has run out
+	 */
+	bool isTimedOut( const StreamBase *stream ) const
+	{
+	    base::Time latestDataTime;
+	    base::Time firstDataTime;
+	    getTimeoutReference( latestDataTime, firstDataTime );
+	    return !(latestDataTime - firstDataTime < getTimeout( stream ));
+	}
+
+	/** @return the maximum time the samples of the stream wait for other
+	 * streams */
+	base::Time getTimeout( const StreamBase *stream ) const
+	{
+	    return stream->timeout.isNull() ? timeout : stream->timeout;
+	}
+
+	/** apply the shrink policy to the chunk pool, called after samples
+	 * have been played out */
+	void updateShrink()
+	{
+	    if( shrink_policy.low_watermark <= 0 )
+		return;
+
+	    const size_t allocated = pool.getAllocatedBytes();
+	    const size_t used = pool.getUsedBytes();
+	    if( used >= shrink_policy.low_watermark * allocated )
+	    {
+		shrink_low_since = base::Time();
+		return;
+	    }
+
+	    if( shrink_low_since == base::Time() )
+		shrink_low_since = current_ts;
+	    else if( current_ts - shrink_low_since >= shrink_policy.window )
+	    {
+		pool.trim( used / shrink_policy.low_watermark );
+		shrink_low_since = base::Time();
+	    }
+	}
+
+    public:
+	explicit StreamAligner(base::Time timeout = base::Time::fromSeconds(1))
+	    : timeout(timeout), buffer_size_factor(2.0), latency_statistics(false), trace(0),
+	    memory_budget(0), memory_budget_policy(DROP_OLDEST), buffered_bytes(0),
+	    pending(0), pending_bytes(0), synchronizer_count(0), ingest_pending(false),
+	    status_version(0), snapshot_back(0), snapshot_front(2), snapshot_middle(1) {}
+
+	virtual ~StreamAligner()
+	{
+	    for(stream_vector::iterator it=streams.begin();it != streams.end();it++)
+		delete *it;
+	}
+
+	/** will take the state of other StreamAligner and make it the state of this 
+	 * object. State constitutes current_time and latest_time as well as all the stream
+	 * content, but not the configuration.
+	 */
+	void copyState(const StreamAligner& other)
+	{
+	    finishPending();
+	    latest_ts = other.latest_ts;
 	    current_ts = other.current_ts;
 
 	    assert( streams.size() == other.streams.size() );
@@ -267,15 +1593,211 @@ namespace aggregator {
 		    streams[i]->copyState( *other.streams[i] );
 		}
 	    }
+	    rebuildQueues();
+	    buffered_bytes = other.buffered_bytes;
+	    resetSynchronizers();
+	}
+
+	/** Set the time the Estimator will wait for an expected reading on any of the streams.
+	 * This number effectively puts an upper limit to the lag that can be created due to 
+	 * delay or missing values on the channels.
+	 */
+	void setTimeout(const base::Time &t )
+	{
+	    timeout = t;
+	}
+
+	/** Set the maximum time the samples of a stream wait for data on
+	 * other streams, in data time.
+	 *
+	 * The oldest buffered sample is played out once this time is over,
+	 * even if other streams are expected to deliver older data. This
+	 * allows fast streams to keep a low latency when a slow, high
+	 * latency stream requires a large timeout for its own samples.
+	 *
+	 * @param t - the timeout of the stream, or a null time to use the
+	 *	timeout of the aligner (the default)
+	 */
+	void setStreamTimeout( int idx, const base::Time &t )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    streams[idx]->timeout = t;
+	}
+
+	/** @return the maximum time the samples of the given stream wait for
+	 * data on other streams */
+	base::Time getStreamTimeout( int idx ) const
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    return getTimeout( streams[idx] );
+	}
+
+	/** Override the lookahead of a stream, i.e. the time after its last
+	 * sample at which its next sample is expected. It is initially the
+	 * period given to registerStream(). The buffer size is not affected.
+	 */
+	void setStreamLookahead( int idx, const base::Time &lookahead )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    streams[idx]->setPeriod( lookahead );
+	    updateQueue( streams[idx] );
+	}
+
+	/** Accept samples which arrive out of order on a stream, as long as
+	 * they are not older than the current time of the aligner and are
+	 * within the given window. Such samples are inserted at their place
+	 * in the stream buffer and counted in samples_reordered, instead of
+	 * being dropped as backward in time.
+	 *
+	 * @param window - the maximum age of a sample relative to the newest
+	 *	sample of the stream, or a null time for no limit
+	 * @param max_samples - the maximum number of buffered samples newer
+	 *	than the sample, or 0 for no limit
+	 *
+	 * Reordering is disabled if both are unlimited (the default). It only
+	 * applies to buffered samples, not to direct dispatch.
+	 */
+	void setStreamReorderWindow( int idx, const base::Time &window, size_t max_samples = 0 )
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+
+	    streams[idx]->reorder_window = window;
+	    streams[idx]->reorder_samples = max_samples;
+	}
+
+	/** Set an upper bound to the wall clock time samples wait in the
+	 * aligner.
+	 *
+	 * The timeout of setTimeout() is measured in data time, so buffered
+	 * data is held back for as long as no newer data comes in. With a
+	 * wall clock timeout, the arrival time of each sample is recorded in
+	 * push(), and the oldest sample gets played out once it has been
+	 * waiting for longer than t on a monotonic clock, regardless of the
+	 * data time. Samples pushed while the wall clock timeout was
+	 * disabled are not affected.
+	 *
+	 * @param t - the timeout, or a null time to disable it (the default)
+	 */
+	void setWallClockTimeout( const base::Time &t )
+	{
+	    wall_timeout = t;
+	}
+
+	base::Time getWallClockTimeout() const { return wall_timeout; }
+
+	/** @return the current time of the monotonic clock used for the wall
+	 * clock timeout */
+	static base::Time getMonotonicTime()
+	{
+	    return base::Time::fromMicroseconds( std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch() ).count() );
+	}
+
+	/** Record, for each stream, the distribution of the wall clock time
+	 * samples spend in the aligner, and of the data time lag between a
+	 * sample and the newest pushed sample at the time of its release. 
+	 * 
+	 * This requires reading a monotonic clock on each push and release,
+	 * so it is disabled by default. Samples pushed while it was disabled
+	 * only count for the release lag.
+	 *
+	 * @see getLatencyStatus
+	 */
+	void setLatencyStatistics( bool enable )
+	{
+	    latency_statistics = enable;
+	}
+
+	bool getLatencyStatistics() const { return latency_statistics; }
+
+	/** Record all pushes, drops and releases into the given trace. 
+	 *
+	 * The trace is not owned by the aligner, and must stay valid until
+	 * it is replaced. Recording reads the monotonic clock on each push
+	 * and release.
+	 *
+	 * @param trace - the trace, or NULL to stop recording (the default)
+	 */
+	void setTrace( StreamTrace *trace )
+	{
+	    this->trace = trace;
+	}
+
+	StreamTrace *getTrace() const { return trace; }
+
+	/** Set the policy used to free the memory of the stream buffers
+	 * after bursts. 
+	 *
+	 * @see ShrinkPolicy
+	 */
+	void setShrinkPolicy( const ShrinkPolicy &policy )
+	{
+	    if( policy.low_watermark < 0 || policy.low_watermark >= 1 )
+		throw std::runtime_error("the low watermark of the shrink policy has to be in [0, 1)");
+	    shrink_policy = policy;
+	    shrink_low_since = base::Time();
+	}
+
+	const ShrinkPolicy &getShrinkPolicy() const { return shrink_policy; }
+
+	/** Free all the memory of the stream buffers which is currently
+	 * unused, regardless of the shrink policy
+	 *
+	 * @return the number of bytes freed
+	 */
+	size_t trimMemory()
+	{
+	    shrink_low_since = base::Time();
+	    return pool.trim( pool.getUsedBytes() );
 	}
 
-	/** Set the time the Estimator will wait for an expected reading on any of the streams.
-	 * This number effectively puts an upper limit to the lag that can be created due to 
-	 * delay or missing values on the channels.
+	/** Limit the memory used by the buffered samples of all streams.
+	 *
+	 * The footprint of each sample is estimated through the SampleSize
+	 * trait, which should be specialized for types owning large amounts
+	 * of memory. When a push brings the total above the budget, the
+	 * given policy is applied until it fits again. Note that with
+	 * FORCE_TIMEOUT, the callbacks get called from within push().
+	 *
+	 * The samples kept after their release for synchronizers and
+	 * lookups are not part of the budget, as they are bounded by their
+	 * retention window instead. Their footprint is reported separately,
+	 * see getRetainedBytes().
+	 *
+	 * @param bytes - the budget in bytes, 0 to disable it (the default)
 	 */
-	void setTimeout(const base::Time &t )
+	void setMemoryBudget( size_t bytes, MemoryBudgetPolicy policy = DROP_OLDEST )
 	{
-	    timeout = t;
+	    memory_budget = bytes;
+	    memory_budget_policy = policy;
+	}
+
+	size_t getMemoryBudget() const { return memory_budget; }
+
+	MemoryBudgetPolicy getMemoryBudgetPolicy() const { return memory_budget_policy; }
+
+	/** @return the approximate memory footprint of all buffered samples */
+	size_t getBufferedBytes() const { return buffered_bytes; }
+
+	/** @return the approximate memory footprint of the samples kept
+	 * after their release, which is not counted in getBufferedBytes()
+	 */
+	size_t getRetainedBytes() const
+	{
+	    size_t bytes = 0;
+	    for(size_t i = 0; i < streams.size(); i++)
+	    {
+		if( streams[i] )
+		    bytes += streams[i]->history_bytes;
+	    }
+	    return bytes;
 	}
 
 	/** 
@@ -296,6 +1818,7 @@ namespace aggregator {
 		throw std::runtime_error("invalid stream index.");		
 
 	    streams[idx]->setActive( false );
+	    updateQueue( streams[idx] );
 	}
 
 	/** 
@@ -310,6 +1833,7 @@ namespace aggregator {
 		throw std::runtime_error("invalid stream index.");		
 
 	    streams[idx]->setActive( true );
+	    updateQueue( streams[idx] );
 	}
 
 	/** 
@@ -338,9 +1862,23 @@ namespace aggregator {
 		throw std::runtime_error("invalid stream index.");		
 	    }
 	    
+	    if( streams[idx] == pending )
+		finishPending();
+	    if( streams[idx]->queue )
+		streams[idx]->queue->remove( streams[idx] );
+	    buffered_bytes -= streams[idx]->buffer_bytes;
+	    ingest_streams.erase( std::remove( ingest_streams.begin(), ingest_streams.end(), streams[idx] ), ingest_streams.end() );
+	    for(size_t i = 0; i < synchronizers.size(); i++)
+	    {
+		const stream_vector &sync_streams( synchronizers[i].streams );
+		if( std::find( sync_streams.begin(), sync_streams.end(), streams[idx] ) != sync_streams.end() )
+		    removeSynchronizer( i );
+	    }
+
 	    delete streams[idx];
 	    
 	    streams[idx] = 0;
+	    generations[idx]++;
 	    
 	    status.streams[idx].active = false;
 	}
@@ -361,11 +1899,18 @@ namespace aggregator {
 	 *      one with the lower priority value will be pushed first.
 	 *
 	 * @param name - name of the stream. This is only for debug purposes
+	 *
+	 * @param timeout - maximum time the samples of this stream wait for
+	 *	data on other streams, which is also used instead of the
+	 *	aligner's timeout to calculate the buffer size. When null,
+	 *	the timeout of the aligner is used. @see setStreamTimeout
 	 * 
-	 * @result - stream index, which is used to identify the stream (e.g. for push).
+	 * @result - handle of the stream, which converts to the stream index
+	 *	used to identify the stream (e.g. for push).
 	 */
-	template <class T> int registerStream( typename Stream<T>::callback_t callback, int bufferSize, base::Time period, int priority  = -1, const std::string &name = std::string()) 
+	template <class T> StreamHandle<T> registerStream( typename Stream<T>::callback_t callback, int bufferSize, base::Time period, int priority  = -1, const std::string &name = std::string(), base::Time timeout = base::Time()) 
 	{
+	    const base::Time horizon = timeout.isNull() ? this->timeout : timeout;
 	    if( bufferSize < 0 )
 	    {
 		if( period == base::Time() )
@@ -375,12 +1920,12 @@ namespace aggregator {
 		else if( period < base::Time() )
 		{
 		    // for a negative period, just calculate the buffer size, but don't set any lookahead.
-		    bufferSize = buffer_size_factor * std::ceil( timeout.toSeconds() / -period.toSeconds() );
+		    bufferSize = buffer_size_factor * std::ceil( horizon.toSeconds() / -period.toSeconds() );
 		    period = base::Time();
 		}
 		else
 		{
-		    bufferSize = buffer_size_factor * std::ceil( timeout.toSeconds() / period.toSeconds() );
+		    bufferSize = buffer_size_factor * std::ceil( horizon.toSeconds() / period.toSeconds() );
 		}
 	    }
 
@@ -389,22 +1934,41 @@ namespace aggregator {
 		LOG_DEBUG_S << "dynamically allocating stream aligner buffer for stream: " << name;
 	    }
 
-	    StreamBase *newStream = new Stream<T>(callback, bufferSize, period, priority, name);
+	    Stream<T> *newStream = new Stream<T>(callback, bufferSize, period, priority, name, pool);
+	    newStream->queue_priority = priority;
+	    newStream->timeout = timeout;
 	    
 	    //check if there is a free slot from a previous deleted stream
-	    for(size_t i = 0; i < streams.size(); i++)
+	    size_t idx = 0;
+	    while( idx < streams.size() && streams[idx] )
+		idx++;
+
+	    if( idx < streams.size() )
 	    {
-		if(!streams[i])
-		{
-		    streams[i] = newStream;
-		    status.streams[i] = StreamStatus();
-		    return i;
-		}
+		streams[idx] = newStream;
+		status.streams[idx] = StreamStatus();
 	    }
-		
-	    streams.push_back( newStream );
-	    status.streams.push_back(StreamStatus());
-	    return streams.size() - 1;
+	    else
+	    {
+		streams.push_back( newStream );
+		generations.push_back( 0 );
+		status.streams.push_back(StreamStatus());
+	    }
+
+	    newStream->index = idx;
+	    updateQueue( newStream );
+	    return StreamHandle<T>( this, newStream, idx, generations[idx] );
+	}
+
+	/** @return true if the handle refers to a stream which is still
+	 * registered with this stream aligner
+	 */
+	template <class T> bool isValid( const StreamHandle<T> &handle ) const
+	{
+	    return handle.aligner == this 
+		&& handle.idx >= 0 && static_cast<size_t>(handle.idx) < streams.size()
+		&& generations[handle.idx] == handle.generation
+		&& streams[handle.idx] == handle.stream;
 	}
 	
 	/** @brief Push new data into the stream
@@ -417,44 +1981,297 @@ namespace aggregator {
 	 */
 	template <class T> void push( int idx, const base::Time &ts, const T& data )
 	{
-	    if( !streams.at(idx) )
-		throw std::runtime_error("invalid stream index.");
+	    pushSample( getStream<T>( idx ), ts, data );
+	}
 
-	    Stream<T>* stream = dynamic_cast<Stream<T>*>(streams[idx]);
-	    assert( stream );
+	/** @overload which moves the data into the stream buffer instead of
+	 * copying it */
+	template <class T> typename std::enable_if<!std::is_reference<T>::value>::type 
+	    push( int idx, const base::Time &ts, T&& data )
+	{
+	    pushSample( getStream<T>( idx ), ts, std::move(data) );
+	}
 
-	    stream->status.samples_received++;
-	    stream->status.latest_sample_time = ts;
+	/** @brief Construct new data in place in the stream 
+	 *
+	 * The sample is constructed from args directly in the stream buffer,
+	 * so that large samples are neither copied nor moved.
+	 */
+	template <class T, class... Args> void emplace( int idx, const base::Time &ts, Args&&... args )
+	{
+	    pushSample( getStream<T>( idx ), ts, std::forward<Args>(args)... );
+	}
 
-	    // mark stream as active, since it is receiving data items will
-	    // have no effect on an already active stream, but enables
-	    // streams which have been marked passive before.
-	    stream->setActive( true );
+	/** @brief Push new data into the stream referred to by the handle
+	 *
+	 * Same as push(int, ...), without the index lookup and type check.
+	 */
+	template <class T> void push( const StreamHandle<T> &handle, const base::Time &ts, const T& data )
+	{
+	    assert( isValid( handle ) );
+	    pushSample( handle.stream, ts, data );
+	}
 
-	    //any sample, that is older than the last replayed sample
-	    //will never be played back and gets dropped by default
-	    if(ts < current_ts) 
+	template <class T> void push( const StreamHandle<T> &handle, const base::Time &ts, T&& data )
+	{
+	    assert( isValid( handle ) );
+	    pushSample( handle.stream, ts, std::move(data) );
+	}
+
+	template <class T, class... Args> void emplace( const StreamHandle<T> &handle, const base::Time &ts, Args&&... args )
+	{
+	    assert( isValid( handle ) );
+	    pushSample( handle.stream, ts, std::forward<Args>(args)... );
+	}
+
+	/** Set a callback which takes over the samples of the stream,
+	 * instead of getting them by const reference. It replaces the
+	 * callback given to registerStream().
+	 */
+	template <class T> void setMoveCallback( const StreamHandle<T> &handle, typename Stream<T>::move_callback_t callback )
+	{
+	    assert( isValid( handle ) );
+	    if( callback && !handle.stream->retention.isNull() )
+		throw std::runtime_error("cannot set a move callback on a stream whose samples are retained");
+	    handle.stream->setMoveCallback( callback );
+	}
+
+	/** Emit the sets of samples, one per stream, which are the closest
+	 * in time to each sample of a reference stream.
+	 *
+	 * The synchronizer works on the samples played out by the aligner,
+	 * which are retained in the stream buffers for twice the maximum
+	 * skew instead of being discarded after their callback, so that the
+	 * samples are not copied. For each sample of the reference stream,
+	 * the sample of each other stream closest in time is searched, the
+	 * earlier one on ties. Once these are known for sure, i.e. once a
+	 * later sample has been played out on each stream or the current
+	 * time of the aligner excludes any closer sample, the callback
+	 * gets called, after the callback of the stream which played out
+	 * the last sample required. If one of the streams has no sample
+	 * within max_skew of the reference, the reference sample is counted
+	 * as unmatched instead. The samples of the other streams can be part
+	 * of several matches.
+	 *
+	 * Matching costs constant time per retained sample. Only the
+	 * samples played out by step(), stepMany() and drain() are seen, not
+	 * the ones handed out by next(). The synchronizers must not be added
+	 * or removed from within callbacks.
+	 *
+	 * @param stream_indices - the streams, starting with the reference
+	 *	stream. None may have a move callback.
+	 * @return the id of the synchronizer
+	 * @throws std::runtime_error on invalid streams
+	 */
+	int addSynchronizer( const std::vector<int> &stream_indices, const base::Time &max_skew, sync_callback_t callback )
+	{
+	    if( stream_indices.size() < 2 )
+		throw std::runtime_error("a synchronizer needs at least two streams");
+
+	    Synchronizer sync;
+	    for(size_t i = 0; i < stream_indices.size(); i++)
 	    {
-		status.samples_dropped_late_arriving++;
-		stream->status.samples_dropped_late_arriving++;
-		return;
+		StreamBase *stream = streams.at( stream_indices[i] );
+		if( !stream )
+		    throw std::runtime_error("invalid stream index.");
+		if( stream->hasMoveCallback() )
+		    throw std::runtime_error("the streams of a synchronizer cannot have a move callback");
+		sync.streams.push_back( stream );
+		sync.cursors.push_back( stream->getHistoryEnd() );
+
+		MatchedSamples::Match match;
+		match.stream_index = stream_indices[i];
+		match.sample = 0;
+		match.type = &stream->getSampleType();
+		sync.samples.matches.push_back( match );
 	    }
+	    sync.max_skew = max_skew;
+	    sync.callback = callback;
+
+	    // reuse the slot of a removed synchronizer
+	    size_t id = 0;
+	    while( id < synchronizers.size() && !synchronizers[id].streams.empty() )
+		id++;
+	    if( id == synchronizers.size() )
+		synchronizers.push_back( sync );
+	    else
+		synchronizers[id] = sync;
+	    synchronizer_count++;
+	    updateRetention();
+	    return id;
+	}
 
-	    if( ts > latest_ts )
-		latest_ts = ts;
-	    
-	    stream->push( ts, data );
+	void removeSynchronizer( int id )
+	{
+	    Synchronizer &sync( synchronizers.at( id ) );
+	    if( sync.streams.empty() )
+		throw std::runtime_error("invalid synchronizer id.");
+	    sync = Synchronizer();
+	    synchronizer_count--;
+	    updateRetention();
+	}
+
+	const SynchronizerStatus &getSynchronizerStatus( int id ) const
+	{
+	    return synchronizers.at( id ).status;
+	}
+
+	/** Let producer threads push into the stream concurrently.
+	 *
+	 * Once enabled, push() and emplace() on this stream only append the
+	 * sample, along with its arrival time, to a lock-free queue of
+	 * queue_size entries, and can be called from any number of threads
+	 * while a single consumer thread calls step(). The samples are moved
+	 * into the stream buffer by the consumer, at the start of step(),
+	 * stepMany() or drain(), or with an explicit call to ingest(). The
+	 * late arrival and backward in time checks, as well as the memory
+	 * budget, are applied at that point. Samples pushed while the queue
+	 * is full are dropped and counted in samples_dropped_ingest_full.
+	 *
+	 * This has to be called before the producers start. Registering or
+	 * unregistering streams, as well as all the other calls, must still
+	 * happen on the consumer thread, and streams must not be registered
+	 * or unregistered while producers are pushing: push() reads the
+	 * stream table, which these calls modify.
+	 */
+	template <class T> void enableConcurrentIngest( const StreamHandle<T> &handle, size_t queue_size = 1024 )
+	{
+	    assert( isValid( handle ) );
+	    if( handle.stream->isConcurrent() )
+		throw std::runtime_error("concurrent ingest is already enabled on this stream.");
+
+	    handle.stream->setIngestQueueSize( queue_size );
+	    ingest_streams.push_back( handle.stream );
+	}
+
+	/** Move the samples which producer threads pushed into streams in
+	 * concurrent ingest mode into the stream buffers. This is done
+	 * implicitly by step(), stepMany() and drain(), and only needs to be
+	 * called before inspecting the buffers otherwise.
+	 */
+	void ingest()
+	{
+	    if( ingest_streams.empty() || !ingest_pending.exchange( false, std::memory_order_acquire ) )
+		return;
+
+	    for(size_t i = 0; i < ingest_streams.size(); i++)
+	    {
+		size_t dropped = ingest_streams[i]->ingest( *this );
+		ingest_streams[i]->status_version = ++status_version;
+		if( trace )
+		{
+		    for( size_t j = 0; j < dropped; j++ )
+			trace->record( TRACE_DROPPED_INGEST_FULL, ingest_streams[i]->index, base::Time(), getMonotonicTime() );
+		}
+	    }
 	}
 
 	template <class T> bool getNextSample( int idx, std::pair<base::Time,T> &sample) const
+	{
+	    return getStream<T>( idx )->getNextSample(sample);
+	}
+
+	template <class T> bool getNextSample( const StreamHandle<T> &handle, std::pair<base::Time,T> &sample) const
+	{
+	    assert( isValid( handle ) );
+	    return handle.stream->getNextSample(sample);
+	}
+
+	/** Keep the samples played out on a stream for the given window of
+	 * data time after their release, so that they can still be looked
+	 * up with sampleAt() and interpolateAt(). The samples are moved into
+	 * a separate buffer once their callback returned, so the stream
+	 * cannot have a move callback. They are removed when the stream plays
+	 * out a sample which is newer by more than the window. Only the
+	 * samples played out by step(), stepMany() and drain() are retained.
+	 * The retained samples do not count against the memory budget, their
+	 * footprint is given by getRetainedBytes().
+	 *
+	 * @param window - the retention window, or a null time to keep no
+	 *	sample besides the ones needed by synchronizers (the default)
+	 */
+	void setStreamRetention( int idx, const base::Time &window )
 	{
 	    if( !streams.at(idx) )
 		throw std::runtime_error("invalid stream index.");
+	    if( !window.isNull() && streams[idx]->hasMoveCallback() )
+		throw std::runtime_error("cannot retain the samples of a stream with a move callback");
 
-	    Stream<T>* stream = dynamic_cast<Stream<T>*>(streams[idx]);
-	    assert( stream );
+	    streams[idx]->lookup_retention = window;
+	    updateRetention();
+	}
+
+	/** Look up the sample of a stream closest to a given time.
+	 *
+	 * The retained samples (see setStreamRetention) and the buffered
+	 * samples, which are not played out yet, are searched by binary
+	 * search. No sample is copied, the returned pointer refers to the
+	 * stream buffers.
+	 *
+	 * @param policy - LOOKUP_NEAREST for the closest sample, the older one
+	 *	on ties, LOOKUP_BEFORE for the newest sample not after t and
+	 *	LOOKUP_AFTER for the oldest sample not before t
+	 * @return the sample and its time, or NULL if there is no such sample.
+	 *	The pointer is valid until the stream gets modified by a push,
+	 *	a release or a call to clear().
+	 */
+	template <class T> const std::pair<base::Time,T> *sampleAt( int idx, const base::Time &t, LookupPolicy policy = LOOKUP_NEAREST ) const
+	{
+	    return sampleAt( getStream<T>( idx ), t, policy );
+	}
+
+	template <class T> const std::pair<base::Time,T> *sampleAt( const StreamHandle<T> &handle, const base::Time &t, LookupPolicy policy = LOOKUP_NEAREST ) const
+	{
+	    assert( isValid( handle ) );
+	    return sampleAt( handle.stream, t, policy );
+	}
+
+	/** Look up the samples of a stream which enclose a given time, i.e.
+	 * the newest sample not after t and the oldest sample not before t.
+	 * Both are the same sample if one has exactly the time t.
+	 *
+	 * @return false if t is not within the samples which can be looked up
+	 * @see sampleAt
+	 */
+	template <class T> bool bracketAt( int idx, const base::Time &t, const std::pair<base::Time,T> *&before, const std::pair<base::Time,T> *&after ) const
+	{
+	    return bracketAt( getStream<T>( idx ), t, before, after );
+	}
+
+	template <class T> bool bracketAt( const StreamHandle<T> &handle, const base::Time &t, const std::pair<base::Time,T> *&before, const std::pair<base::Time,T> *&after ) const
+	{
+	    assert( isValid( handle ) );
+	    return bracketAt( handle.stream, t, before, after );
+	}
+
+	/** Compute the sample of a stream at a given time from the samples
+	 * returned by bracketAt(), with the Interpolation trait of the
+	 * sample type.
+	 *
+	 * @return false if t is not within the samples which can be looked
+	 *	up, in which case result is not modified
+	 */
+	template <class T> bool interpolateAt( int idx, const base::Time &t, T &result ) const
+	{
+	    return interpolateAt( idx, t, result, &Interpolation<T>::interpolate );
+	}
+
+	template <class T> bool interpolateAt( const StreamHandle<T> &handle, const base::Time &t, T &result ) const
+	{
+	    return interpolateAt( handle, t, result, &Interpolation<T>::interpolate );
+	}
+
+	/** @overload with a user provided interpolation, which gets called
+	 * as interpolate( t, before, after, result ) */
+	template <class T, class F> bool interpolateAt( int idx, const base::Time &t, T &result, F interpolate ) const
+	{
+	    return interpolateAt( getStream<T>( idx ), t, result, interpolate );
+	}
 
-	    return stream->getNextSample(sample);
+	template <class T, class F> bool interpolateAt( const StreamHandle<T> &handle, const base::Time &t, T &result, F interpolate ) const
+	{
+	    assert( isValid( handle ) );
+	    return interpolateAt( handle.stream, t, result, interpolate );
 	}
 
 	/** This will go through the available streams and look for the
@@ -471,74 +2288,175 @@ namespace aggregator {
 	 *    case, the oldest data (which is obviously non-available) is ignored,
 	 *    and only newer data is considered.
 	 *
+	 * The streams are kept in priority queues which are only updated
+	 * when the next timestamp of a stream changes, so that a call costs
+	 * O(log N) in the number of streams.
+	 *
 	 *  @result - true if a callback was called and more data might be available 
 	 */
 	bool step()
 	{
-	    if( streams.empty() )
+	    finishPending();
+	    ingest();
+	    if( data_queue.empty() )
+		return false;
+
+	    // the stream with the oldest sample can only be played out if no
+	    // active stream is expected to deliver older data, or if waiting
+	    // for that data has timed out.
+	    if( isBlocked() )
 		return false;
 
-	    // copy streams vector and sort it by next ts
-	    stream_vector items = streams;
-	    std::sort( items.begin(), items.end(), &compareStreams );
+	    release( data_queue.top() );
+	    updateShrink();
+	    return true;
+	}
 
-	    for(stream_vector::iterator it=items.begin();it != items.end();it++)
+	/** Plays out up to max_samples samples, in the same order and with
+	 * the same timeout handling as repeated calls to step().
+	 *
+	 * The release horizon, i.e. the earliest time at which an active
+	 * stream may deliver new data, is computed once. All samples up to
+	 * that horizon are played out without any further checks, and only
+	 * samples after it are subject to the timeout logic of step().
+	 * Samples which are pushed from within the callbacks are not taken
+	 * into account for the horizon.
+	 *
+	 * @result the number of samples which have been played out and the
+	 *	resulting current time of the aligner
+	 */
+	std::pair<size_t, base::Time> stepMany( size_t max_samples )
+	{
+	    size_t count = 0;
+	    finishPending();
+	    ingest();
+	    if( data_queue.empty() )
+		return std::make_pair( count, current_ts );
+
+	    const base::Time horizon = getReleaseHorizon();
+	    while( count < max_samples && !data_queue.empty() )
 	    {
-		//first stream is unregistered no data there
-		if(!*it)
-		    return false;
-		
-		if( (*it)->hasData() ) 
-		{
-		    // if stream has current data, pop that data
-		    current_ts = (*it)->pop();
-		    return true;
-		}
-		else if( (*it)->isActive() )
-		{
+		StreamBase *stream = data_queue.top();
+		if( stream->queue_time > horizon && isBlocked() )
+		    break;
 
-		    base::Time latestDataTime;
-		    base::Time firstDataTime;
-		    
-		    //initalization case
-		    if(current_ts == base::Time())
-		    {
-			//check if one stream timed out
-			for(stream_vector::iterator it2=items.begin();it2 != items.end();it2++)
-			{
-			    
-			    if(*it2 && (*it2)->hasData())
-			    {
-				if(latestDataTime < (*it2)->latestDataTime())
-				    latestDataTime = (*it2)->latestDataTime();
-				
-				if(firstDataTime == base::Time() || firstDataTime > (*it2)->earliestDataTime())
-				    firstDataTime = (*it2)->earliestDataTime();
-			    }
-			}			
-		    } else {
-			latestDataTime = latest_ts;
-			firstDataTime = current_ts;
-		    }
+		release( stream );
+		count++;
+	    }
+	    if( count )
+		updateShrink();
+	    return std::make_pair( count, current_ts );
+	}
 
-		    if(latestDataTime - firstDataTime < timeout)
-		    {
-			// if there is no data, but the expected data has
-			// not run out yet, wait for it.
-			return false;
-		    }
-		}
+	/** Plays out all the samples which can currently be released.
+	 * 
+	 * This is equivalent to calling step() until it returns false, but
+	 * avoids re-evaluating the timeout for each sample. 
+	 *
+	 * @see stepMany
+	 */
+	std::pair<size_t, base::Time> drain()
+	{
+	    return stepMany( std::numeric_limits<size_t>::max() );
+	}
+
+	/** A sample handed out by next() */
+	class AlignedSample
+	{
+	    friend class StreamAligner;
+
+	    int stream_index;
+	    base::Time time;
+	    void *sample;
+	    const std::type_info *type;
+
+	    template <class T> T *getPointer() const
+	    {
+		if( !sample || *type != typeid(T) )
+		    throw std::bad_cast();
+		return static_cast<T*>( sample );
+	    }
+
+	public:
+	    AlignedSample() : stream_index( -1 ), sample( 0 ), type( 0 ) {}
+
+	    /** @return the index of the stream the sample comes from, -1
+	     * if there is no sample */
+	    int getStreamIndex() const { return stream_index; }
+
+	    /** @return the timestamp of the sample */
+	    base::Time getTime() const { return time; }
+
+	    /** @return true if the sample is of type T */
+	    template <class T> bool is() const
+	    {
+		return sample && *type == typeid(T);
+	    }
+
+	    /** @return a reference to the sample, which is still stored in
+	     * the stream buffer. 
+	     * @throws std::bad_cast if the sample is not of type T */
+	    template <class T> const T &get() const
+	    {
+		return *getPointer<T>();
+	    }
+
+	    /** @return the sample, moved out of the stream buffer 
+	     * @throws std::bad_cast if the sample is not of type T */
+	    template <class T> T take()
+	    {
+		return std::move( *getPointer<T>() );
 	    }
-	    return false;
+	};
+
+	/** Hands out the next sample which step() would play out, without
+	 * calling the callback of its stream.
+	 *
+	 * This allows the consumer to process the aligned samples in its own
+	 * loop. To avoid a copy, the sample stays in the stream buffer until
+	 * the next call to next(), step(), stepMany(), drain(), push() or
+	 * emplace() on the consumer thread, or clear(). It is only valid up
+	 * to that point. As with step(), the current time of the aligner
+	 * is the time of the returned sample.
+	 *
+	 * Both styles can be mixed. The callbacks are simply not called for
+	 * the samples returned by next().
+	 *
+	 * @result true if a sample has been handed out
+	 */
+	bool next( AlignedSample &sample )
+	{
+	    finishPending();
+	    ingest();
+	    sample = AlignedSample();
+	    if( data_queue.empty() || isBlocked() )
+		return false;
+
+	    StreamBase *stream = data_queue.top();
+	    if( latency_statistics )
+		recordLatency( stream );
+	    if( trace )
+		trace->record( TRACE_RELEASE, stream->index, stream->earliestDataTime(), getMonotonicTime() );
+	    sample.stream_index = stream->index;
+	    sample.time = stream->earliestDataTime();
+	    sample.sample = stream->frontSample();
+	    sample.type = &stream->getSampleType();
+	    current_ts = sample.time;
+	    pending = stream;
+	    pending_bytes = stream->frontBytes();
+	    return true;
 	}
 
 	/**
 	 * clears all samples in all streams, resets the statistics
 	 * and resets the playback times  but leaves the stream
-	 * setup intact.
+	 * setup intact. Samples pushed to concurrent ingest queues which
+	 * have not been ingested yet are discarded as well.
 	 */
 	void clear()
 	{
+	    pending = 0;
+	    ingest_pending.store( false, std::memory_order_relaxed );
 	    for(size_t i = 0; i < streams.size(); i++)
 	    {
 		if(streams[i])
@@ -546,13 +2464,18 @@ namespace aggregator {
 		    streams[i]->clear();
 		}
 	    }
+	    rebuildQueues();
+	    buffered_bytes = 0;
 	    
 	    latest_ts = base::Time();
 	    current_ts = base::Time();
+	    shrink_low_since = base::Time();
 	    
 	    status.current_time = base::Time();
 	    status.latest_time = base::Time();
 	    status.samples_dropped_late_arriving = 0;
+	    status.samples_dropped_memory_budget = 0;
+	    status.samples_released_memory_budget = 0;
 	}
 
 	/** Get the time the Estimator will wait for an expected reading on any of the streams.
@@ -560,6 +2483,66 @@ namespace aggregator {
 	 * delay or missing values on the channels.
 	 */
 	base::Time getTimeOut() const { return timeout; };
+
+	/** Result of getWaitDeadline() */
+	struct WaitDeadline
+	{
+	    /** true if step() would play out a sample right away */
+	    bool releasable;
+	    /** index of the stream the aligner is waiting for, or -1 if it is
+	     * not waiting for any stream */
+	    int blocking_stream;
+	    /** data time at which the next sample of the blocking stream is
+	     * expected */
+	    base::Time expected_time;
+	    /** data time the newest pushed sample has to reach for the wait
+	     * on the blocking stream to time out */
+	    base::Time timeout_time;
+	    /** monotonic time at which the wall clock timeout expires, null if
+	     * there is no wall clock timeout. @see getMonotonicTime */
+	    base::Time wall_timeout_time;
+
+	    WaitDeadline() : releasable( false ), blocking_stream( -1 ) {}
+	};
+
+	/** Tells when the aligner will be able to play out data again, so
+	 * that a consumer can sleep instead of polling step().
+	 *
+	 * If data can be played out right away, releasable is set. If the
+	 * oldest buffered sample has to wait for a stream which is expected
+	 * to deliver older data, that stream is given in blocking_stream.
+	 * The wait ends either when that stream delivers data, or when a
+	 * sample with a time of at least timeout_time gets pushed on any
+	 * stream, or with a wall clock timeout, at wall_timeout_time. If no
+	 * data is buffered at all, blocking_stream is -1 and only a new
+	 * sample can change the state.
+	 */
+	WaitDeadline getWaitDeadline() const
+	{
+	    WaitDeadline result;
+	    if( data_queue.empty() )
+		return result;
+
+	    if( !isBlocked() )
+	    {
+		result.releasable = true;
+		return result;
+	    }
+
+	    base::Time latestDataTime;
+	    base::Time firstDataTime;
+	    getTimeoutReference( latestDataTime, firstDataTime );
+
+	    const StreamBase *blocking = wait_queue.top();
+	    result.blocking_stream = blocking->index;
+	    result.expected_time = blocking->queue_time;
+	    result.timeout_time = firstDataTime + getTimeout( data_queue.top() );
+
+	    base::Time arrival = data_queue.top()->earliestArrivalTime();
+	    if( !wall_timeout.isNull() && !arrival.isNull() )
+		result.wall_timeout_time = arrival + wall_timeout;
+	    return result;
+	}
 	
 	/** latency is the time difference between the latest data item that
 	 * has come in, and the latest data item that went out
@@ -589,22 +2572,109 @@ namespace aggregator {
 	    return streams[idx]->getBufferStatus();
 	}
 
+	/** @return the latency statistics of a stream, which are only
+	 * recorded when enabled with setLatencyStatistics()
+	 */
+	const StreamLatencyStatus &getLatencyStatus(int idx) const
+	{
+	    if( !streams.at(idx) )
+		throw std::runtime_error("invalid stream index.");
+	    
+	    return streams[idx]->getLatencyStatus();
+	}
+
 	/** @return the current status of the StreamAligner
 	 * this is mainly used for debug purposes
 	 */
 	const StreamAlignerStatus& getStatus() const 
 	{
-	    status.time = base::Time::now();
-	    status.current_time = getCurrentTime();
-	    status.latest_time = getLatestTime();
+	    updateStatus( status, status_versions, status_generations );
+	    return status;
+	}
+
+	/** Make a snapshot of the current status available to readStatus().
+	 *
+	 * This is meant to be called from the thread which calls step(),
+	 * e.g. once per cycle, while a monitoring thread polls
+	 * readStatus(). Neither side ever waits for the other. Only the
+	 * streams which changed since the snapshot buffer was last written
+	 * are copied, and stream names are only copied once, so that this
+	 * does not allocate once all the streams are registered.
+	 */
+	void publishStatus()
+	{
+	    StatusCopy &back( snapshots[snapshot_back] );
+	    updateStatus( back.status, back.versions, back.generations );
+	    snapshot_back = snapshot_middle.exchange( snapshot_back | SNAPSHOT_FRESH, std::memory_order_acq_rel ) & SNAPSHOT_INDEX;
+	}
 
-	    for(size_t i=0;i<streams.size();i++)
+	/** @return the status given to the last call to publishStatus().
+	 *
+	 * This can be called from a single monitoring thread, concurrently
+	 * with the thread calling step(). The returned status stays valid
+	 * until the next call to readStatus(). 
+	 */
+	const StreamAlignerStatus& readStatus()
+	{
+	    if( snapshot_middle.load( std::memory_order_relaxed ) & SNAPSHOT_FRESH )
+		snapshot_front = snapshot_middle.exchange( snapshot_front, std::memory_order_acq_rel ) & SNAPSHOT_INDEX;
+	    return snapshots[snapshot_front].status;
+	}
+
+    protected:
+	/** Play out a sample right away, as if it had been pushed and
+	 * released by step(), but without buffering it and without looking
+	 * at the timeout. 
+	 *
+	 * This is meant for callers which merge the samples of all streams
+	 * in time order themselves, and therefore only gives the same
+	 * result as push() and step() while nothing is buffered. Samples
+	 * older than the current time or than the previous sample of the
+	 * stream are dropped, like with push().
+	 */
+	template <class T> void dispatch( int idx, const base::Time &ts, T &data )
+	{
+	    Stream<T> *stream = getStream<T>( idx );
+	    finishPending();
+	    stream->status.samples_received++;
+	    if( ts > stream->status.latest_sample_time )
+		stream->status.latest_sample_time = ts;
+	    stream->setActive( true );
+
+	    if( ts < current_ts )
 	    {
-		if(streams[i])
-		    status.streams[i] = streams[i]->getBufferStatus();
+		status.samples_dropped_late_arriving++;
+		stream->status.samples_dropped_late_arriving++;
+		if( trace )
+		    trace->record( TRACE_DROPPED_LATE, idx, ts, getMonotonicTime() );
+		updateQueue( stream );
+		return;
 	    }
 
-	    return status;
+	    if( ts > latest_ts )
+		latest_ts = ts;
+
+	    const base::Time arrival = trace ? getMonotonicTime() : base::Time();
+	    const bool dispatched = stream->dispatch( ts, data );
+	    if( trace )
+	    {
+		trace->record( dispatched ? TRACE_PUSH : TRACE_DROPPED_BACKWARD, idx, ts, arrival );
+		if( dispatched )
+		    trace->record( TRACE_RELEASE, idx, ts, arrival );
+	    }
+	    if( dispatched )
+	    {
+		if( latency_statistics )
+		    stream->latency.release_lag.add( latest_ts - ts );
+		current_ts = ts;
+	    }
+	    updateQueue( stream );
+	}
+
+	/** @return true if samples are waiting in the stream buffers */
+	bool hasBufferedSamples() const
+	{
+	    return !data_queue.empty();
 	}
 
 	friend std::ostream &operator<<(std::ostream &stream, const aggregator::StreamAligner::StreamBase &base);
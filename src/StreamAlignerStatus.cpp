@@ -1,4 +1,36 @@
 #include "StreamAlignerStatus.hpp"
+#include <algorithm>
+
+using namespace aggregator;
+
+int64_t TimeHistogram::getBucketLimit( int bucket )
+{
+    if( bucket < sub_bucket_count )
+	return bucket;
+
+    int shift = bucket / sub_bucket_count - 1;
+    int64_t sub_bucket = bucket % sub_bucket_count + sub_bucket_count;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+base::Time TimeHistogram::getPercentile( double fraction ) const
+{
+    if( !total )
+	return base::Time();
+
+    uint64_t rank = fraction * total;
+    if( rank >= total )
+	rank = total - 1;
+
+    uint64_t count = 0;
+    for( int i = 0; i < bucket_count; i++ )
+    {
+	count += counts[i];
+	if( count > rank )
+	    return base::Time::fromMicroseconds( std::min( getBucketLimit( i ), max ) );
+    }
+    return getMax();
+}
 
 std::ostream &operator<<(std::ostream &os, const aggregator::StreamAlignerStatus &status)
 {
@@ -9,18 +41,30 @@ std::ostream &operator<<(std::ostream &os, const aggregator::StreamAlignerStatus
 	<< " latest time: \t" 
 	<< " dropped late samples: \t" << status.samples_dropped_late_arriving 
 	<< " latency: \t" 
+	<< " dropped budget: \t" 
+	<< " released budget: \t" 
+	<< " buffered bytes: \t" 
+	<< " retained bytes: \t" 
+	<< " allocated bytes: \t" 
+	<< " reclaimed bytes: \t" 
 	<< std::endl
 	<<  status.time
 	<< "\t" << status.current_time 
 	<< "\t" << status.latest_time 
 	<< "\t" << status.samples_dropped_late_arriving 
 	<< "\t" << status.latest_time - status.current_time 
+	<< "\t" << status.samples_dropped_memory_budget 
+	<< "\t" << status.samples_released_memory_budget 
+	<< "\t" << status.buffered_bytes 
+	<< "\t" << status.retained_bytes 
+	<< "\t" << status.buffer_bytes_allocated 
+	<< "\t" << status.buffer_bytes_reclaimed 
 	<< std::endl;
 	
     if( status.streams.empty() )
     	return os; 
     
-    os << "idx\tname\t\tbsize\tbfill\treceived\tprocessed\tdr_bfull\tdr_late\tbackward time" << std::endl;
+    os << "idx\tname\t\tbsize\tbfill\treceived\tprocessed\tdr_bfull\tdr_late\tbackward time\tdr_budget\trel_budget\tdr_ingest\treordered" << std::endl;
 
     int cnt = 0;
     for(std::vector<aggregator::StreamStatus>::const_iterator it = status.streams.begin(); it != status.streams.end(); it++)
@@ -57,6 +101,10 @@ std::ostream& counters(std::ostream& os, const aggregator::StreamStatus& status)
 	<< status.samples_dropped_buffer_full << "\t"
 	<< status.samples_dropped_late_arriving << "\t"
 	<< status.samples_backward_in_time << "\t"
+	<< status.samples_dropped_memory_budget << "\t"
+	<< status.samples_released_memory_budget << "\t"
+	<< status.samples_dropped_ingest_full << "\t"
+	<< status.samples_reordered << "\t"
 	<< std::endl;
     return os;
 }
@@ -68,9 +116,24 @@ std::ostream& timers(std::ostream& os, const aggregator::StreamStatus& status, b
 	<< status.latest_sample_time << "\t"
 	<< status.earliest_data_time << " \t "
 	<< status.latest_data_time << " \t " 
-	<< status.latest_sample_time - current_time 
+	<< status.latest_sample_time - current_time
 	<< std::endl;
     return os;
 }
 
 
+
+std::ostream &operator<<(std::ostream &os, const aggregator::StreamLatencyStatus &status)
+{
+    using ::operator <<;
+    os
+	<< "res p50\tres p99\tres max\tlag p50\tlag p99\tlag max" << std::endl
+	<< status.residency_time.getPercentile( 0.5 ) << "\t"
+	<< status.residency_time.getPercentile( 0.99 ) << "\t"
+	<< status.residency_time.getMax() << "\t"
+	<< status.release_lag.getPercentile( 0.5 ) << "\t"
+	<< status.release_lag.getPercentile( 0.99 ) << "\t"
+	<< status.release_lag.getMax()
+	<< std::endl;
+    return os;
+}
@@ -3,9 +3,79 @@
 
 #include <base/Time.hpp>
 #include <vector>
+#include <stdint.h>
 
 namespace aggregator 
 {
+    /** Histogram of durations with a fixed memory footprint
+     *
+     * The buckets are log-linear: each power of two of microseconds is
+     * split into 2^sub_bucket_bits buckets of equal width, so that the
+     * relative error of a percentile is at most 1/2^sub_bucket_bits,
+     * from 1 microsecond up to about 9 hours. Longer durations are
+     * counted in the last bucket.
+     */
+    struct TimeHistogram
+    {
+	static const int sub_bucket_bits = 3;
+	static const int sub_bucket_count = 1 << sub_bucket_bits;
+	/** durations up to 2^max_exponent microseconds are resolved */
+	static const int max_exponent = 35;
+	static const int bucket_count = (max_exponent - sub_bucket_bits + 2) * sub_bucket_count;
+
+	/** number of durations per bucket */
+	uint32_t counts[bucket_count];
+	/** total number of durations */
+	uint64_t total;
+	/** longest duration, in microseconds */
+	int64_t max;
+
+	TimeHistogram() { clear(); }
+
+	void clear()
+	{
+	    for( int i = 0; i < bucket_count; i++ )
+		counts[i] = 0;
+	    total = 0;
+	    max = 0;
+	}
+
+	/** @return the bucket of a duration in microseconds */
+	static int getBucket( int64_t us )
+	{
+	    if( us < sub_bucket_count )
+		return us < 0 ? 0 : us;
+
+	    int exponent = 63 - __builtin_clzll( us );
+	    if( exponent > max_exponent )
+		return bucket_count - 1;
+	    int shift = exponent - sub_bucket_bits;
+	    return (shift + 1) * sub_bucket_count + ((us >> shift) & (sub_bucket_count - 1));
+	}
+
+	/** @return the largest duration in microseconds counted in the
+	 * given bucket */
+	static int64_t getBucketLimit( int bucket );
+
+	void add( const base::Time &duration )
+	{
+	    const int64_t us = duration.toMicroseconds();
+	    counts[getBucket( us )]++;
+	    total++;
+	    if( us > max )
+		max = us;
+	}
+
+	uint64_t getCount() const { return total; }
+
+	/** @return the duration below which the given fraction of the
+	 * durations lie (e.g. 0.99 for the 99th percentile), with the
+	 * resolution of the buckets. Null if the histogram is empty. */
+	base::Time getPercentile( double fraction ) const;
+
+	base::Time getMax() const { return base::Time::fromMicroseconds( max ); }
+    };
+
     /** Debugging structure used to report about the status of a single stream in a stream aligner
      */
     struct StreamStatus
@@ -14,13 +84,23 @@ namespace aggregator
 	size_t buffer_size;
 	/** How many samples are currently waiting inside the stream buffer */
 	size_t buffer_fill;
+	/** Approximate memory footprint of the samples currently waiting
+	 * inside the stream buffer, in bytes
+	 */
+	size_t buffer_bytes;
+	/** Approximate memory footprint of the samples kept after their
+	 * release for synchronizers and lookups, in bytes
+	 */
+	size_t retained_bytes;
 	/** The total number of samples ever received for that stream
 	 * 
 	 * The following relationship should hold:
 	 *   
 	 *   samples_received == samples_processed +
 	 * 	samples_dropped_buffer_full +
-	 * 	samples_dropped_late_arriving
+	 * 	samples_dropped_late_arriving +
+	 * 	samples_dropped_memory_budget +
+	 * 	samples_dropped_ingest_full
 	 */
 	size_t samples_received;
 	/** The total count of samples ever processed by the callbacks of this stream
@@ -28,6 +108,7 @@ namespace aggregator
 	 * The total number of samples ever received is
 	 *   
 	 *   samples_processed + samples_dropped_buffer_full + samples_dropped_late_arriving
+	 *   + samples_dropped_memory_budget + samples_dropped_ingest_full
 	 */
 	size_t samples_processed;
 	/** Count of samples dropped because the buffer was full
@@ -39,12 +120,30 @@ namespace aggregator
 	 * the stream aligner current time
 	 */
 	size_t samples_dropped_late_arriving;
+	/** Count of samples dropped to keep the stream aligner within its
+	 * memory budget
+	 */
+	size_t samples_dropped_memory_budget;
+	/** Count of samples played out before the timeout to keep the
+	 * stream aligner within its memory budget. These samples are also
+	 * counted in samples_processed.
+	 */
+	size_t samples_released_memory_budget;
+	/** Count of samples dropped because the concurrent ingest queue of
+	 * the stream was full when they got pushed
+	 */
+	size_t samples_dropped_ingest_full;
 	/** Count of samples dropped because their timestamp was not properly ordered
 	 * 
 	 * I.e. samples for which the timestamp was later than the previous
 	 * sample received for that stream
 	 */
 	size_t samples_backward_in_time;
+	/** Count of samples received out of order which have been inserted
+	 * at their place in the stream buffer, within the reorder window of
+	 * the stream
+	 */
+	size_t samples_reordered;
 	/** Time of the newest sample currently stored in the stream buffer.
 	 * Null time if the stream is empty
 	 */
@@ -53,8 +152,8 @@ namespace aggregator
 	 * Null time if the stream is empty
 	 */
 	base::Time earliest_data_time;	
-	/** Time of the last sample received for this stream, regardless of
-	 * whether it has been dropped or pushed to the stream
+	/** Time of the newest sample received for this stream, regardless
+	 * of whether it has been dropped or pushed to the stream
 	 */
 	base::Time latest_sample_time;
 	/** True if the stream is being used by the stream aligner */
@@ -69,11 +168,64 @@ namespace aggregator
 	 */
 	int64_t priority;
 	
-	StreamStatus() : buffer_size(0), buffer_fill(0), samples_received(0), 
+	StreamStatus() : buffer_size(0), buffer_fill(0), buffer_bytes(0), retained_bytes(0), samples_received(0), 
 			samples_processed(0), samples_dropped_buffer_full(0), 
 			samples_dropped_late_arriving(0), 
-			samples_backward_in_time(0), active(true), priority(0)
+			samples_dropped_memory_budget(0), samples_released_memory_budget(0),
+			samples_dropped_ingest_full(0), samples_backward_in_time(0), samples_reordered(0), active(true), priority(0)
+	{
+	}
+
+	/** Copy all the fields of the given status but the name, which
+	 * avoids allocating when only the counters changed
+	 */
+	void copyWithoutName( const StreamStatus &other )
+	{
+	    buffer_size = other.buffer_size;
+	    buffer_fill = other.buffer_fill;
+	    buffer_bytes = other.buffer_bytes;
+	    retained_bytes = other.retained_bytes;
+	    samples_received = other.samples_received;
+	    samples_processed = other.samples_processed;
+	    samples_dropped_buffer_full = other.samples_dropped_buffer_full;
+	    samples_dropped_late_arriving = other.samples_dropped_late_arriving;
+	    samples_dropped_memory_budget = other.samples_dropped_memory_budget;
+	    samples_released_memory_budget = other.samples_released_memory_budget;
+	    samples_dropped_ingest_full = other.samples_dropped_ingest_full;
+	    samples_backward_in_time = other.samples_backward_in_time;
+	    samples_reordered = other.samples_reordered;
+	    latest_data_time = other.latest_data_time;
+	    earliest_data_time = other.earliest_data_time;
+	    latest_sample_time = other.latest_sample_time;
+	    active = other.active;
+	    priority = other.priority;
+	}
+    };
+
+    /** Latency statistics of a single stream in a stream aligner
+     *
+     * This is kept apart from StreamStatus, as the histograms are much
+     * larger than the rest of the status and are only filled when latency
+     * statistics are enabled on the stream aligner.
+     *
+     * @see StreamAligner::setLatencyStatistics
+     */
+    struct StreamLatencyStatus
+    {
+	/** Wall clock time between the push of a sample and its release to
+	 * the callback or through next()
+	 */
+	TimeHistogram residency_time;
+	/** Data time between the sample at release and the newest sample of
+	 * the stream aligner at that point, i.e. the latency added by the
+	 * alignment
+	 */
+	TimeHistogram release_lag;
+
+	void clear()
 	{
+	    residency_time.clear();
+	    release_lag.clear();
 	}
     };
 
@@ -106,11 +258,38 @@ namespace aggregator
 	 * earlier than the stream's declared period (i.e. the period is too big).
 	 */
 	size_t samples_dropped_late_arriving;
+	/** Count of samples that got dropped to keep the memory footprint of
+	 * all buffered samples within the memory budget
+	 */
+	size_t samples_dropped_memory_budget;
+	/** Count of samples that got played out before the timeout to keep
+	 * the memory footprint of all buffered samples within the memory
+	 * budget
+	 */
+	size_t samples_released_memory_budget;
+	/** Approximate memory footprint of all buffered samples, in bytes
+	 */
+	size_t buffered_bytes;
+	/** Approximate memory footprint of the samples of all streams kept
+	 * after their release, in bytes. These are not part of the memory
+	 * budget.
+	 */
+	size_t retained_bytes;
+	/** Memory currently allocated for the buffers of all streams, in
+	 * bytes. This includes unused memory kept for reuse.
+	 */
+	size_t buffer_bytes_allocated;
+	/** Total memory of the stream buffers which has been given back to
+	 * the system by the shrink policy, in bytes
+	 */
+	size_t buffer_bytes_reclaimed;
 	/** Status of each individual streams
 	 */
 	std::vector<StreamStatus> streams;
 	
-	StreamAlignerStatus() : samples_dropped_late_arriving(0)
+	StreamAlignerStatus() : samples_dropped_late_arriving(0),
+			samples_dropped_memory_budget(0), samples_released_memory_budget(0),
+			buffered_bytes(0), retained_bytes(0), buffer_bytes_allocated(0), buffer_bytes_reclaimed(0)
 	{
 	}	
     };
@@ -119,6 +298,7 @@ namespace aggregator
 
 std::ostream &operator<<(std::ostream &os, const aggregator::StreamAlignerStatus &status);
 std::ostream &operator<<(std::ostream &os, const aggregator::StreamStatus &status);
+std::ostream &operator<<(std::ostream &os, const aggregator::StreamLatencyStatus &status);
 std::ostream& counters(std::ostream& os, const aggregator::StreamStatus& status);
 std::ostream& timers(std::ostream& os, const aggregator::StreamStatus& status, base::Time current_time);
 
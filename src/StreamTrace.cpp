@@ -0,0 +1,221 @@
+#include "StreamTrace.hpp"
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace aggregator;
+
+namespace
+{
+    const char trace_magic[8] = { 'A', 'G', 'G', 'T', 'R', 'A', 'C', 'E' };
+    const uint32_t trace_version = 1;
+
+    struct TraceHeader
+    {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t record_count;
+	uint64_t lost_count;
+    };
+
+    void checkHeader( const TraceHeader &header, const std::string &path )
+    {
+	if( std::memcmp( header.magic, trace_magic, sizeof(trace_magic) ) != 0 )
+	    throw std::runtime_error(path + " is not a stream aligner trace");
+	if( header.version != trace_version || header.record_size != sizeof(TraceRecord) )
+	    throw std::runtime_error(path + " has an unsupported trace format");
+    }
+}
+
+StreamTrace::StreamTrace( size_t capacity )
+    : count( 0 )
+{
+    size_t size = 1;
+    while( size < capacity )
+	size *= 2;
+    records.resize( size );
+    mask = size - 1;
+}
+
+void StreamTrace::getRecords( std::vector<TraceRecord> &result ) const
+{
+    result.clear();
+    result.reserve( size() );
+    for( uint64_t i = count - size(); i < count; i++ )
+	result.push_back( records[i & mask] );
+}
+
+void StreamTrace::save( const std::string &path ) const
+{
+    std::ofstream file( path.c_str(), std::ios::binary );
+    if( !file )
+	throw std::runtime_error("cannot open " + path + " for writing");
+
+    TraceHeader header;
+    std::memcpy( header.magic, trace_magic, sizeof(trace_magic) );
+    header.version = trace_version;
+    header.record_size = sizeof(TraceRecord);
+    header.record_count = size();
+    header.lost_count = getLostCount();
+    file.write( reinterpret_cast<const char*>( &header ), sizeof(header) );
+
+    // the ring is written in two parts, oldest first
+    const size_t first = (count - size()) & mask;
+    const size_t first_part = std::min<size_t>( size(), records.size() - first );
+    file.write( reinterpret_cast<const char*>( &records[first] ), first_part * sizeof(TraceRecord) );
+    file.write( reinterpret_cast<const char*>( &records[0] ), (size() - first_part) * sizeof(TraceRecord) );
+    if( !file )
+	throw std::runtime_error("failed to write the trace to " + path);
+}
+
+const char *StreamTrace::getEventName( TraceEvent event )
+{
+    switch( event )
+    {
+	case TRACE_PUSH: return "push";
+	case TRACE_DROPPED_LATE: return "dropped_late";
+	case TRACE_DROPPED_BACKWARD: return "dropped_backward";
+	case TRACE_DROPPED_BUFFER_FULL: return "dropped_buffer_full";
+	case TRACE_DROPPED_MEMORY_BUDGET: return "dropped_memory_budget";
+	case TRACE_DROPPED_INGEST_FULL: return "dropped_ingest_full";
+	case TRACE_RELEASE: return "release";
+	case TRACE_RELEASE_MEMORY_BUDGET: return "release_memory_budget";
+	default: return "unknown";
+    }
+}
+
+MappedStreamTrace::MappedStreamTrace( const std::string &path )
+    : data( MAP_FAILED ), length( 0 ), records( 0 ), record_count( 0 ), lost( 0 )
+{
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd < 0 )
+	throw std::runtime_error("cannot open " + path);
+
+    struct stat st;
+    if( fstat( fd, &st ) == 0 && static_cast<size_t>( st.st_size ) >= sizeof(TraceHeader) )
+    {
+	length = st.st_size;
+	data = mmap( 0, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    }
+    close( fd );
+    if( data == MAP_FAILED )
+	throw std::runtime_error("cannot map " + path);
+
+    const TraceHeader &header( *static_cast<const TraceHeader*>( data ) );
+    try
+    {
+	checkHeader( header, path );
+	if( length < sizeof(TraceHeader) + header.record_count * sizeof(TraceRecord) )
+	    throw std::runtime_error(path + " is truncated");
+    }
+    catch( ... )
+    {
+	munmap( data, length );
+	throw;
+    }
+
+    records = reinterpret_cast<const TraceRecord*>( static_cast<const char*>( data ) + sizeof(TraceHeader) );
+    record_count = header.record_count;
+    lost = header.lost_count;
+}
+
+MappedStreamTrace::~MappedStreamTrace()
+{
+    munmap( data, length );
+}
+
+StreamTraceReader::StreamTraceReader( const std::string &path )
+    : lost( 0 )
+{
+    load( path );
+}
+
+void StreamTraceReader::load( const std::string &path )
+{
+    std::ifstream file( path.c_str(), std::ios::binary );
+    if( !file )
+	throw std::runtime_error("cannot open " + path);
+
+    TraceHeader header;
+    file.read( reinterpret_cast<char*>( &header ), sizeof(header) );
+    if( !file )
+	throw std::runtime_error(path + " is not a stream aligner trace");
+    checkHeader( header, path );
+
+    records.resize( header.record_count );
+    file.read( reinterpret_cast<char*>( records.data() ), records.size() * sizeof(TraceRecord) );
+    if( !file )
+	throw std::runtime_error(path + " is truncated");
+    lost = header.lost_count;
+}
+
+size_t StreamTraceReader::count( TraceEvent event, int stream ) const
+{
+    size_t result = 0;
+    for( size_t i = 0; i < records.size(); i++ )
+    {
+	if( records[i].event == event && (stream == -1 || records[i].stream == stream) )
+	    result++;
+    }
+    return result;
+}
+
+void StreamTraceReader::computeLatencies( std::vector<TimeHistogram> &residency, std::vector<TimeHistogram> &lag ) const
+{
+    // samples which are buffered, per stream, by time. Samples may be
+    // pushed out of order when the stream reorders, but are released in
+    // order. Samples of equal time are kept in the order of their push.
+    typedef std::multimap<int64_t, const TraceRecord*> BufferedSamples;
+    std::vector<BufferedSamples> buffered;
+    int64_t latest = 0;
+    residency.clear();
+    lag.clear();
+    for( size_t i = 0; i < records.size(); i++ )
+    {
+	const TraceRecord &r( records[i] );
+	if( r.stream < 0 )
+	    continue;
+	if( static_cast<size_t>( r.stream ) >= buffered.size() )
+	{
+	    buffered.resize( r.stream + 1 );
+	    residency.resize( r.stream + 1 );
+	    lag.resize( r.stream + 1 );
+	}
+
+	BufferedSamples &samples( buffered[r.stream] );
+	BufferedSamples::iterator pushed;
+	switch( r.event )
+	{
+	    case TRACE_PUSH:
+		samples.insert( samples.end(), std::make_pair( r.time, &r ) );
+		latest = std::max( latest, r.time );
+		break;
+	    case TRACE_RELEASE:
+	    case TRACE_RELEASE_MEMORY_BUDGET:
+	    case TRACE_DROPPED_BUFFER_FULL:
+	    case TRACE_DROPPED_MEMORY_BUDGET:
+		// samples pushed before the start of the trace are not
+		// matched
+		pushed = samples.lower_bound( r.time );
+		samples.erase( samples.begin(), pushed );
+		if( pushed == samples.end() || pushed->first != r.time )
+		    break;
+		if( r.event == TRACE_RELEASE || r.event == TRACE_RELEASE_MEMORY_BUDGET )
+		{
+		    residency[r.stream].add( base::Time::fromMicroseconds( r.wall_time - pushed->second->wall_time ) );
+		    lag[r.stream].add( base::Time::fromMicroseconds( latest - r.time ) );
+		}
+		samples.erase( pushed );
+		break;
+	    default:
+		break;
+	}
+    }
+}
@@ -0,0 +1,169 @@
+#ifndef __AGGREGATOR_STREAMTRACE_HPP__
+#define __AGGREGATOR_STREAMTRACE_HPP__
+
+#include <base/Time.hpp>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <aggregator/StreamAlignerStatus.hpp>
+
+namespace aggregator
+{
+    /** What happened to a sample in a stream aligner */
+    enum TraceEvent
+    {
+	/** the sample has been added to the stream buffer */
+	TRACE_PUSH,
+	/** the sample was older than the current time of the aligner */
+	TRACE_DROPPED_LATE,
+	/** the sample was older than the previous sample of its stream */
+	TRACE_DROPPED_BACKWARD,
+	/** the sample was the oldest of a full stream buffer and got
+	 * replaced by a new one, or was reordered into a full buffer while
+	 * older than all the buffered samples */
+	TRACE_DROPPED_BUFFER_FULL,
+	/** the sample got dropped by the memory budget */
+	TRACE_DROPPED_MEMORY_BUDGET,
+	/** the sample was pushed while the concurrent ingest queue of its
+	 * stream was full. Its time is unknown. */
+	TRACE_DROPPED_INGEST_FULL,
+	/** the sample has been played out */
+	TRACE_RELEASE,
+	/** the sample has been played out early by the memory budget */
+	TRACE_RELEASE_MEMORY_BUDGET,
+	TRACE_EVENT_COUNT
+    };
+
+    /** A single entry of a StreamTrace */
+    struct TraceRecord
+    {
+	/** data time of the sample, in microseconds */
+	int64_t time;
+	/** monotonic time of the event, in microseconds. For pushes, this
+	 * is the arrival time of the sample */
+	int64_t wall_time;
+	/** index of the stream */
+	int32_t stream;
+	/** a TraceEvent */
+	uint16_t event;
+	uint16_t reserved;
+    };
+
+    /** Recorder for the pushes and releases of a stream aligner.
+     *
+     * The records are written to a ring which is allocated once, so that
+     * recording does not allocate. When the ring is full, the oldest
+     * records get overwritten. The content can be saved to a compact
+     * binary file and loaded back with StreamTraceReader.
+     *
+     * @see StreamAligner::setTrace
+     */
+    class StreamTrace
+    {
+	std::vector<TraceRecord> records;
+	size_t mask;
+	/** total number of records ever written */
+	uint64_t count;
+
+    public:
+	/** @param capacity - the number of records kept, rounded up to the
+	 *	next power of two */
+	explicit StreamTrace( size_t capacity = 65536 );
+
+	void record( TraceEvent event, int stream, const base::Time &time, const base::Time &wall_time )
+	{
+	    TraceRecord &r( records[count & mask] );
+	    r.time = time.toMicroseconds();
+	    r.wall_time = wall_time.toMicroseconds();
+	    r.stream = stream;
+	    r.event = event;
+	    r.reserved = 0;
+	    count++;
+	}
+
+	size_t capacity() const { return records.size(); }
+
+	/** @return the number of records currently held */
+	size_t size() const { return count < records.size() ? count : records.size(); }
+
+	/** @return the number of records which have been overwritten */
+	uint64_t getLostCount() const { return count - size(); }
+
+	/** copy the records currently held, oldest first */
+	void getRecords( std::vector<TraceRecord> &result ) const;
+
+	void clear() { count = 0; }
+
+	/** write the records currently held to a file
+	 * @throws std::runtime_error if the file cannot be written */
+	void save( const std::string &path ) const;
+
+	static const char *getEventName( TraceEvent event );
+    };
+
+    /** Read-only view of a trace file mapped into memory, for traces too
+     * large to be loaded at once */
+    class MappedStreamTrace
+    {
+	void *data;
+	size_t length;
+	const TraceRecord *records;
+	size_t record_count;
+	uint64_t lost;
+
+	MappedStreamTrace( const MappedStreamTrace& );
+	MappedStreamTrace& operator=( const MappedStreamTrace& );
+
+    public:
+	/** @throws std::runtime_error if the file cannot be mapped or is not
+	 * a valid trace */
+	explicit MappedStreamTrace( const std::string &path );
+	~MappedStreamTrace();
+
+	const TraceRecord *begin() const { return records; }
+	const TraceRecord *end() const { return records + record_count; }
+	size_t size() const { return record_count; }
+	const TraceRecord &operator[]( size_t i ) const { return records[i]; }
+
+	/** @return the number of records the recorder had to overwrite
+	 * before the file got written */
+	uint64_t getLostCount() const { return lost; }
+    };
+
+    /** Decodes the files written by StreamTrace::save() */
+    class StreamTraceReader
+    {
+	std::vector<TraceRecord> records;
+	uint64_t lost;
+
+    public:
+	StreamTraceReader() : lost( 0 ) {}
+
+	/** @throws std::runtime_error if the file is not a valid trace */
+	explicit StreamTraceReader( const std::string &path );
+
+	/** @throws std::runtime_error if the file is not a valid trace */
+	void load( const std::string &path );
+
+	const std::vector<TraceRecord> &getRecords() const { return records; }
+
+	/** @return the number of records the recorder had to overwrite
+	 * before the file got written */
+	uint64_t getLostCount() const { return lost; }
+
+	/** @return the number of records with the given event, on the given
+	 * stream or on all streams if stream is -1 */
+	size_t count( TraceEvent event, int stream = -1 ) const;
+
+	/** Match the releases and drops of each stream with its pushes by
+	 * sample time, so that reordered samples are matched as well, and
+	 * fill per stream histograms of the wall clock time between both
+	 * (residency) and of the data time between the released sample and
+	 * the newest pushed sample at release (lag). Samples pushed before
+	 * the start of the trace are ignored.
+	 */
+	void computeLatencies( std::vector<TimeHistogram> &residency, std::vector<TimeHistogram> &lag ) const;
+    };
+}
+
+#endif
@@ -0,0 +1,298 @@
+/** Offline replay of a recorded StreamTrace.
+ *
+ * The samples recorded in a trace file (see StreamAligner::setTrace) are
+ * pushed, in the order in which they arrived, into a new StreamAligner
+ * configured from a small text file, and the aligner is drained after each
+ * push. This re-runs hours of recorded data in seconds, so that timeout and
+ * buffer settings can be evaluated against it.
+ *
+ * Samples which the recorded aligner dropped as late or backward in time
+ * are pushed as well, as they were part of its input. Samples lost in a
+ * full ingest queue carry no time and are skipped.
+ *
+ * The replay does not depend on the clock: the residency time of a sample
+ * is measured between the recorded arrival of the sample and the recorded
+ * arrival of the sample whose push released it. For the same reason, wall
+ * clock timeouts are not replayed. Samples still waiting at the end of the
+ * trace are reported as buffered.
+ *
+ * The configuration has one setting per line, '#' starts a comment:
+ *
+ *   timeout 0.5
+ *   stream 0 period 0.01 priority 0 buffer 200 timeout 0.1 name imu
+ *
+ * Stream options are period, priority, buffer, timeout, lookahead, reorder
+ * (all times in seconds) and name. Streams of the trace which are not
+ * configured get a dynamic buffer and no period.
+ *
+ * usage: aggregator-replay [--order file] trace [config]
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstring>
+
+#include <aggregator/StreamAligner.hpp>
+#include <aggregator/StreamTrace.hpp>
+
+using namespace aggregator;
+
+struct StreamConfig
+{
+    base::Time period;
+    int priority;
+    int buffer_size;
+    base::Time timeout;
+    base::Time lookahead;
+    base::Time reorder;
+    std::string name;
+
+    StreamConfig()
+	: priority( -1 ), buffer_size( 0 ) {}
+};
+
+struct ReplayConfig
+{
+    base::Time timeout;
+    std::vector<StreamConfig> streams;
+
+    ReplayConfig()
+	: timeout( base::Time::fromSeconds( 1 ) ) {}
+};
+
+static void parseConfig( const std::string &path, ReplayConfig &config )
+{
+    std::ifstream file( path.c_str() );
+    if( !file )
+	throw std::runtime_error("cannot open " + path);
+
+    std::string line;
+    for( int line_number = 1; std::getline( file, line ); line_number++ )
+    {
+	std::istringstream in( line.substr( 0, line.find( '#' ) ) );
+	std::string key;
+	if( !(in >> key) )
+	    continue;
+
+	std::ostringstream where;
+	where << path << ":" << line_number << ": ";
+	if( key == "timeout" )
+	{
+	    double seconds;
+	    if( !(in >> seconds) )
+		throw std::runtime_error(where.str() + "expected a timeout in seconds");
+	    config.timeout = base::Time::fromSeconds( seconds );
+	}
+	else if( key == "stream" )
+	{
+	    int idx;
+	    if( !(in >> idx) || idx < 0 )
+		throw std::runtime_error(where.str() + "expected a stream index");
+	    if( static_cast<size_t>( idx ) >= config.streams.size() )
+		config.streams.resize( idx + 1 );
+	    StreamConfig &stream( config.streams[idx] );
+
+	    std::string option;
+	    while( in >> option )
+	    {
+		double seconds;
+		if( option == "name" )
+		    in >> stream.name;
+		else if( option == "priority" )
+		    in >> stream.priority;
+		else if( option == "buffer" )
+		    in >> stream.buffer_size;
+		else if( option == "period" && in >> seconds )
+		    stream.period = base::Time::fromSeconds( seconds );
+		else if( option == "timeout" && in >> seconds )
+		    stream.timeout = base::Time::fromSeconds( seconds );
+		else if( option == "lookahead" && in >> seconds )
+		    stream.lookahead = base::Time::fromSeconds( seconds );
+		else if( option == "reorder" && in >> seconds )
+		    stream.reorder = base::Time::fromSeconds( seconds );
+		else
+		    throw std::runtime_error(where.str() + "invalid stream option " + option);
+		if( !in )
+		    throw std::runtime_error(where.str() + "missing value for " + option);
+	    }
+	}
+	else
+	    throw std::runtime_error(where.str() + "unknown setting " + key);
+    }
+}
+
+/** The payload of the replayed samples is the index of the record which
+ * pushed them */
+typedef uint64_t RecordIndex;
+
+class Replay
+{
+    const MappedStreamTrace &trace;
+    StreamAligner aligner;
+    std::vector<TimeHistogram> residency;
+    std::vector<TimeHistogram> lag;
+    std::ostream *order;
+    /** the record being pushed */
+    size_t current;
+    int64_t latest;
+
+    struct Callback
+    {
+	Replay *replay;
+	int stream;
+
+	void operator()( const base::Time &ts, const RecordIndex &record ) const
+	{
+	    replay->released( stream, ts, record );
+	}
+    };
+
+    void released( int stream, const base::Time &ts, RecordIndex record )
+    {
+	residency[stream].add( base::Time::fromMicroseconds( trace[current].wall_time - trace[record].wall_time ) );
+	lag[stream].add( base::Time::fromMicroseconds( latest - ts.toMicroseconds() ) );
+	if( order )
+	    *order << stream << " " << ts.toMicroseconds() << " " << record << "\n";
+    }
+
+public:
+    Replay( const MappedStreamTrace &trace, const ReplayConfig &config, std::ostream *order )
+	: trace( trace ), aligner( config.timeout ), order( order ), current( 0 ), latest( 0 )
+    {
+	int stream_count = 0;
+	for( size_t i = 0; i < trace.size(); i++ )
+	    stream_count = std::max( stream_count, trace[i].stream + 1 );
+	stream_count = std::max<int>( stream_count, config.streams.size() );
+
+	for( int s = 0; s < stream_count; s++ )
+	{
+	    StreamConfig stream;
+	    if( static_cast<size_t>( s ) < config.streams.size() )
+		stream = config.streams[s];
+	    std::ostringstream name;
+	    name << "stream" << s;
+
+	    Callback callback = { this, s };
+	    int idx = aligner.registerStream<RecordIndex>( callback, stream.buffer_size, stream.period,
+		    stream.priority, stream.name.empty() ? name.str() : stream.name, stream.timeout );
+	    if( !stream.lookahead.isNull() )
+		aligner.setStreamLookahead( idx, stream.lookahead );
+	    if( !stream.reorder.isNull() )
+		aligner.setStreamReorderWindow( idx, stream.reorder );
+	}
+	residency.resize( stream_count );
+	lag.resize( stream_count );
+    }
+
+    void run()
+    {
+	for( current = 0; current < trace.size(); current++ )
+	{
+	    const TraceRecord &r( trace[current] );
+	    if( r.stream < 0 || (r.event != TRACE_PUSH && r.event != TRACE_DROPPED_LATE && r.event != TRACE_DROPPED_BACKWARD) )
+		continue;
+
+	    latest = std::max( latest, r.time );
+	    aligner.push( r.stream, base::Time::fromMicroseconds( r.time ), static_cast<RecordIndex>( current ) );
+	    aligner.drain();
+	}
+    }
+
+    void report( std::ostream &out ) const
+    {
+	const StreamAlignerStatus &status( aligner.getStatus() );
+	out << "records " << trace.size() << ", lost by the recorder " << trace.getLostCount() << "\n";
+	out << "dropped late arriving " << status.samples_dropped_late_arriving << "\n";
+	out << std::left << std::setw(16) << "stream"
+	    << std::right << std::setw(10) << "received"
+	    << std::setw(10) << "released"
+	    << std::setw(10) << "dr_late"
+	    << std::setw(10) << "dr_back"
+	    << std::setw(10) << "dr_full"
+	    << std::setw(10) << "reorder"
+	    << std::setw(10) << "buffered"
+	    << std::setw(12) << "lag_p50"
+	    << std::setw(12) << "lag_p99"
+	    << std::setw(12) << "lag_max"
+	    << std::setw(12) << "res_p50"
+	    << std::setw(12) << "res_p99"
+	    << std::setw(12) << "res_max" << "\n";
+	for( size_t s = 0; s < status.streams.size(); s++ )
+	{
+	    const StreamStatus &st( status.streams[s] );
+	    out << std::left << std::setw(16) << st.name
+		<< std::right << std::setw(10) << st.samples_received
+		<< std::setw(10) << st.samples_processed
+		<< std::setw(10) << st.samples_dropped_late_arriving
+		<< std::setw(10) << st.samples_backward_in_time
+		<< std::setw(10) << st.samples_dropped_buffer_full
+		<< std::setw(10) << st.samples_reordered
+		<< std::setw(10) << st.buffer_fill
+		<< std::setw(12) << lag[s].getPercentile( 0.5 ).toSeconds()
+		<< std::setw(12) << lag[s].getPercentile( 0.99 ).toSeconds()
+		<< std::setw(12) << lag[s].getMax().toSeconds()
+		<< std::setw(12) << residency[s].getPercentile( 0.5 ).toSeconds()
+		<< std::setw(12) << residency[s].getPercentile( 0.99 ).toSeconds()
+		<< std::setw(12) << residency[s].getMax().toSeconds() << "\n";
+	}
+    }
+};
+
+static void usage()
+{
+    std::cerr << "usage: aggregator-replay [--order file] trace [config]\n"
+	"  replays the samples of a recorded stream aligner trace and reports\n"
+	"  drop counts, release lag and residency time per stream\n"
+	"  --order file  write the release order, one 'stream time_us record' line per sample\n";
+}
+
+int main( int argc, char **argv )
+{
+    std::string order_path;
+    std::vector<std::string> args;
+    for( int i = 1; i < argc; i++ )
+    {
+	if( std::strcmp( argv[i], "--order" ) == 0 && i + 1 < argc )
+	    order_path = argv[++i];
+	else if( argv[i][0] == '-' )
+	{
+	    usage();
+	    return 1;
+	}
+	else
+	    args.push_back( argv[i] );
+    }
+    if( args.empty() || args.size() > 2 )
+    {
+	usage();
+	return 1;
+    }
+
+    try
+    {
+	ReplayConfig config;
+	if( args.size() > 1 )
+	    parseConfig( args[1], config );
+
+	std::ofstream order;
+	if( !order_path.empty() )
+	{
+	    order.open( order_path.c_str() );
+	    if( !order )
+		throw std::runtime_error("cannot open " + order_path + " for writing");
+	}
+
+	MappedStreamTrace trace( args[0] );
+	Replay replay( trace, config, order_path.empty() ? 0 : &order );
+	replay.run();
+	replay.report( std::cout );
+    }
+    catch( const std::exception &e )
+    {
+	std::cerr << e.what() << std::endl;
+	return 1;
+    }
+    return 0;
+}
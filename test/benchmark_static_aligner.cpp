@@ -0,0 +1,107 @@
+/** Compares the per-sample overhead of StreamAligner and
+ * StaticStreamAligner.
+ *
+ * Four periodic streams of doubles are fed in time order, and each push is
+ * followed by a step(), which is the usual pattern of a component driven
+ * by its input ports.
+ *
+ * usage: staticaligner-bench [samples]
+ */
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+#include <aggregator/StreamAligner.hpp>
+#include <aggregator/StaticStreamAligner.hpp>
+
+using namespace aggregator;
+
+static double sum = 0;
+
+static void sum_callback( const base::Time &ts, const double &value )
+{
+    sum += value;
+}
+
+struct SumFunctor
+{
+    void operator()( const base::Time &ts, const double &value ) const
+    {
+	sum += value;
+    }
+};
+
+template <class F> static double measure( const char *name, size_t samples, F run )
+{
+    sum = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    run();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>( end - start ).count() / static_cast<double>( samples );
+    std::cout << name << "\t" << ns << " ns/sample\t(checksum " << sum << ")" << std::endl;
+    return ns;
+}
+
+static const int streams = 4;
+
+int main( int argc, char **argv )
+{
+    size_t samples = 1000000;
+    if( argc > 1 )
+	samples = std::strtoul( argv[1], 0, 10 );
+
+    const base::Time period = base::Time::fromMicroseconds( 1000 );
+    const base::Time timeout = base::Time::fromSeconds( 1 );
+
+    measure( "dynamic (index)", samples, [&]()
+    {
+	StreamAligner aligner( timeout );
+	int idx[streams];
+	for( int s = 0; s < streams; s++ )
+	    idx[s] = aligner.registerStream<double>( &sum_callback, -1, period, s );
+	for( size_t i = 0; i < samples; i++ )
+	{
+	    const int s = i % streams;
+	    aligner.push( idx[s], base::Time::fromMicroseconds( (i / streams + 1) * 1000 ), static_cast<double>( i ) );
+	    while( aligner.step() );
+	}
+    } );
+
+    measure( "dynamic (handle)", samples, [&]()
+    {
+	StreamAligner aligner( timeout );
+	StreamAligner::StreamHandle<double> handles[streams];
+	for( int s = 0; s < streams; s++ )
+	    handles[s] = aligner.registerStream<double>( &sum_callback, -1, period, s );
+	for( size_t i = 0; i < samples; i++ )
+	{
+	    const int s = i % streams;
+	    handles[s].push( base::Time::fromMicroseconds( (i / streams + 1) * 1000 ), static_cast<double>( i ) );
+	    while( aligner.step() );
+	}
+    } );
+
+    measure( "static", samples, [&]()
+    {
+	const size_t size = 2 * timeout.toMicroseconds() / period.toMicroseconds();
+	auto aligner = makeStaticStreamAligner( timeout,
+		makeStaticStream<double>( SumFunctor(), size, period, 0 ),
+		makeStaticStream<double>( SumFunctor(), size, period, 1 ),
+		makeStaticStream<double>( SumFunctor(), size, period, 2 ),
+		makeStaticStream<double>( SumFunctor(), size, period, 3 ) );
+	for( size_t i = 0; i < samples; i += streams )
+	{
+	    const base::Time ts = base::Time::fromMicroseconds( (i / streams + 1) * 1000 );
+	    aligner.push<0>( ts, static_cast<double>( i ) );
+	    while( aligner.step() );
+	    aligner.push<1>( ts, static_cast<double>( i + 1 ) );
+	    while( aligner.step() );
+	    aligner.push<2>( ts, static_cast<double>( i + 2 ) );
+	    while( aligner.step() );
+	    aligner.push<3>( ts, static_cast<double>( i + 3 ) );
+	    while( aligner.step() );
+	}
+    } );
+
+    return 0;
+}
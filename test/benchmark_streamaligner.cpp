@@ -0,0 +1,252 @@
+/** Throughput and allocation benchmark of StreamAligner.
+ *
+ * Sweeps the number of streams, the buffer mode (fixed size computed from
+ * the period, or dynamically growing with bufferSize=0), the sample size
+ * and the arrival jitter, and measures for each configuration the time
+ * per push(), the time per released sample in step() and the number of
+ * heap allocations per sample. The results are written as JSON, so that
+ * they can be compared across releases.
+ *
+ * Samples are pushed by const reference, so for the large samples the
+ * copy into the stream buffer is part of the push time and of the
+ * allocations. Configurations which would buffer more than 256 MB are
+ * skipped.
+ *
+ * usage: streamaligner-bench [--quick] [output.json]
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <aggregator/StreamAligner.hpp>
+
+using namespace aggregator;
+
+// the replacement operators below pair malloc and free, which gcc cannot
+// tell from inside them
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static size_t allocation_count = 0;
+static size_t allocated_bytes = 0;
+
+void* operator new( size_t size )
+{
+    allocation_count++;
+    allocated_bytes += size;
+    void *p = std::malloc( size ? size : 1 );
+    if( !p )
+	throw std::bad_alloc();
+    return p;
+}
+
+void operator delete( void *p ) noexcept
+{
+    std::free( p );
+}
+
+void operator delete( void *p, size_t ) noexcept
+{
+    std::free( p );
+}
+
+struct Config
+{
+    size_t streams;
+    bool dynamic_buffer;
+    size_t sample_bytes;
+    /** maximum delay of a sample, as a fraction of the period */
+    double jitter;
+    size_t samples;
+};
+
+struct Result
+{
+    double push_ns;
+    double step_ns;
+    double allocations_per_sample;
+    double allocated_bytes_per_sample;
+    size_t released;
+    size_t dropped;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsedNs( const bench_clock::time_point &start, const bench_clock::time_point &end )
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( end - start ).count();
+}
+
+static size_t released_count = 0;
+
+template <class T> static void countCallback( const base::Time &ts, const T &sample )
+{
+    released_count++;
+}
+
+/** small POD sample */
+struct Small
+{
+    double value;
+};
+
+struct Event
+{
+    size_t stream;
+    base::Time time;
+    /** time at which the sample gets pushed */
+    base::Time arrival;
+
+    bool operator<( const Event &other ) const { return arrival < other.arrival; }
+};
+
+template <class T> static Result run( const Config &config, const T &sample )
+{
+    const base::Time period = base::Time::fromMilliseconds( 10 );
+    StreamAligner aligner( base::Time::fromSeconds( 1 ) );
+    std::vector< StreamAligner::StreamHandle<T> > handles;
+    for( size_t s = 0; s < config.streams; s++ )
+	handles.push_back( aligner.registerStream<T>( &countCallback<T>, config.dynamic_buffer ? 0 : -1, period ) );
+
+    // pushes happen in batches of whole ticks, of at least a few hundred
+    // samples so that the clock overhead does not dominate
+    const size_t ticks = std::max<size_t>( 1, config.samples / config.streams );
+    const size_t ticks_per_batch = std::max<size_t>( 1, std::min<size_t>( 50, 256 / config.streams ) );
+
+    unsigned seed = 1;
+    std::vector<Event> events;
+    events.reserve( ticks_per_batch * config.streams );
+
+    released_count = 0;
+    double push_ns = 0, step_ns = 0;
+    const size_t allocations_start = allocation_count;
+    const size_t bytes_start = allocated_bytes;
+    for( size_t tick = 0; tick < ticks; tick += ticks_per_batch )
+    {
+	// generate the events outside of the measurements. Jitter delays
+	// the arrival of samples by less than a period, so that the streams
+	// arrive out of order, but each stream stays ordered
+	events.clear();
+	for( size_t t = tick; t < std::min( ticks, tick + ticks_per_batch ); t++ )
+	{
+	    const base::Time time = base::Time::fromMicroseconds( (t + 1) * period.toMicroseconds() );
+	    for( size_t s = 0; s < config.streams; s++ )
+	    {
+		seed = seed * 1103515245 + 12345;
+		const int64_t delay = config.jitter * period.toMicroseconds() * ((seed >> 8) % 1024) / 1024;
+		Event e = { s, time, time + base::Time::fromMicroseconds( delay ) };
+		events.push_back( e );
+	    }
+	}
+	std::stable_sort( events.begin(), events.end() );
+
+	bench_clock::time_point start = bench_clock::now();
+	for( size_t i = 0; i < events.size(); i++ )
+	    handles[events[i].stream].push( events[i].time, sample );
+	bench_clock::time_point pushed = bench_clock::now();
+	while( aligner.step() );
+	bench_clock::time_point stepped = bench_clock::now();
+
+	push_ns += elapsedNs( start, pushed );
+	step_ns += elapsedNs( pushed, stepped );
+    }
+
+    const size_t pushed = ticks * config.streams;
+    const StreamAlignerStatus &status( aligner.getStatus() );
+    size_t dropped = status.samples_dropped_late_arriving;
+    for( size_t s = 0; s < status.streams.size(); s++ )
+	dropped += status.streams[s].samples_dropped_buffer_full + status.streams[s].samples_backward_in_time;
+
+    Result result;
+    result.push_ns = push_ns / pushed;
+    result.step_ns = released_count ? step_ns / released_count : 0;
+    result.allocations_per_sample = static_cast<double>( allocation_count - allocations_start ) / pushed;
+    result.allocated_bytes_per_sample = static_cast<double>( allocated_bytes - bytes_start ) / pushed;
+    result.released = released_count;
+    result.dropped = dropped;
+    return result;
+}
+
+static Result run( const Config &config )
+{
+    if( config.sample_bytes <= sizeof(Small) )
+	return run( config, Small() );
+    return run( config, std::vector<uint8_t>( config.sample_bytes ) );
+}
+
+int main( int argc, char **argv )
+{
+    bool quick = false;
+    std::string output;
+    for( int i = 1; i < argc; i++ )
+    {
+	if( std::strcmp( argv[i], "--quick" ) == 0 )
+	    quick = true;
+	else
+	    output = argv[i];
+    }
+
+    const size_t stream_counts[] = { 1, 10, 100, 1000 };
+    const size_t sample_sizes[] = { sizeof(Small), 1024, 64 * 1024, 1024 * 1024 };
+    const double jitters[] = { 0, 0.5 };
+    const size_t max_buffered_bytes = 256 * 1024 * 1024;
+
+    std::ostringstream json;
+    json << "{\n  \"engine\": \"StreamAligner\",\n  \"results\": [";
+    bool first = true;
+    for( size_t st = 0; st < sizeof(stream_counts) / sizeof(*stream_counts); st++ )
+    for( int dynamic = 0; dynamic < 2; dynamic++ )
+    for( size_t sz = 0; sz < sizeof(sample_sizes) / sizeof(*sample_sizes); sz++ )
+    for( size_t j = 0; j < sizeof(jitters) / sizeof(*jitters); j++ )
+    {
+	Config config;
+	config.streams = stream_counts[st];
+	config.dynamic_buffer = dynamic;
+	config.sample_bytes = sample_sizes[sz];
+	config.jitter = jitters[j];
+	// keep the amount of copied data roughly constant
+	config.samples = std::max<size_t>( config.streams, std::min<size_t>( quick ? 20000 : 200000,
+		    (quick ? 256 : 2048) * 1024 * 1024 / config.sample_bytes ) );
+
+	// a full batch of ticks is buffered before stepping
+	if( config.streams * std::max<size_t>( 1, std::min<size_t>( 50, 256 / config.streams ) ) * config.sample_bytes > max_buffered_bytes )
+	    continue;
+
+	Result result = run( config );
+	json << (first ? "" : ",") << "\n    { "
+	    << "\"streams\": " << config.streams
+	    << ", \"buffer\": \"" << (config.dynamic_buffer ? "dynamic" : "fixed") << "\""
+	    << ", \"sample_bytes\": " << config.sample_bytes
+	    << ", \"jitter\": " << config.jitter
+	    << ", \"samples\": " << config.samples
+	    << ", \"push_ns\": " << result.push_ns
+	    << ", \"step_ns\": " << result.step_ns
+	    << ", \"allocations_per_sample\": " << result.allocations_per_sample
+	    << ", \"allocated_bytes_per_sample\": " << result.allocated_bytes_per_sample
+	    << ", \"released\": " << result.released
+	    << ", \"dropped\": " << result.dropped
+	    << " }";
+	first = false;
+	std::cerr << "streams " << config.streams << (config.dynamic_buffer ? " dynamic" : " fixed")
+	    << " bytes " << config.sample_bytes << " jitter " << config.jitter
+	    << ": push " << result.push_ns << " ns, step " << result.step_ns << " ns, "
+	    << result.allocations_per_sample << " allocs/sample" << std::endl;
+    }
+    json << "\n  ]\n}\n";
+
+    if( output.empty() )
+	std::cout << json.str();
+    else
+    {
+	std::ofstream file( output.c_str() );
+	file << json.str();
+    }
+    return 0;
+}
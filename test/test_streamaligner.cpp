@@ -4,13 +4,19 @@
 
 #include <iostream>
 #include <numeric>
+#include <thread>
+#include <chrono>
+#include <deque>
 
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/test/unit_test.hpp>
 #include <boost/test/execution_monitor.hpp>  
 
 #include <aggregator/StreamAligner.hpp>
 #include <aggregator/PullStreamAligner.hpp>
+#include <aggregator/StaticStreamAligner.hpp>
+#include <aggregator/StreamTrace.hpp>
 
 using namespace aggregator;
 using namespace std;
@@ -439,3 +445,1511 @@ BOOST_AUTO_TEST_CASE( pull_stream_test )
     lastSample = ""; reader.step(); BOOST_CHECK_EQUAL( lastSample, "b" );
 }
 
+
+struct pull_sequence
+{
+    vector< std::pair<base::Time, string> > samples;
+    size_t position;
+    int seeks;
+
+    pull_sequence() : position( 0 ), seeks( 0 ) {}
+
+    void add( double ts, const string &value )
+    {
+	samples.push_back( std::make_pair( base::Time::fromSeconds( ts ), value ) );
+    }
+
+    bool getNext( base::Time& ts, string& next )
+    {
+	if( position == samples.size() )
+	    return false;
+	ts = samples[position].first;
+	next = samples[position].second;
+	position++;
+	return true;
+    }
+
+    /** lands on the sample before ts, like a seek to a key frame */
+    void seek( const base::Time &ts )
+    {
+	seeks++;
+	position = 0;
+	while( position + 1 < samples.size() && samples[position + 1].first < ts )
+	    position++;
+    }
+};
+
+vector<string> pulled;
+
+void pulled_callback( const base::Time &time, const string& sample )
+{
+    pulled.push_back( sample );
+}
+
+BOOST_AUTO_TEST_CASE( pull_merge_test )
+{
+    PullStreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+
+    pull_sequence p[4];
+    for( int i = 0; i < 4; i++ )
+	reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p[i], _1, _2 ), &pulled_callback, 0, base::Time(), 3 - i );
+
+    p[0].add( 1.0, "a1" ); p[0].add( 3.0, "a3" ); p[0].add( 5.0, "a5" );
+    p[1].add( 2.0, "b2" ); p[1].add( 3.0, "b3" );
+    p[2].add( 0.5, "c0" ); p[2].add( 6.0, "c6" );
+    // p[3] starts empty and gets data later
+
+    pulled.clear();
+    int count = 0;
+    while( reader.pull() )
+	count++;
+    BOOST_CHECK_EQUAL( count, 7 );
+
+    p[3].add( 7.0, "d7" );
+    p[3].add( 7.0, "d7'" );
+    p[1].add( 7.0, "b7" );
+    while( reader.pull() )
+	count++;
+    BOOST_CHECK_EQUAL( count, 10 );
+
+    while( reader.step() );
+    reader.setTimeout( base::Time() );
+    while( reader.step() );
+
+    // equal times are ordered by priority, which is higher for the later
+    // streams
+    const char* expected[] = { "c0", "a1", "b2", "b3", "a3", "a5", "c6", "d7", "d7'", "b7" };
+    BOOST_CHECK_EQUAL_COLLECTIONS( pulled.begin(), pulled.end(), expected, expected + 10 );
+}
+
+struct pull_failure
+{
+    int calls;
+    int failing_call;
+    explicit pull_failure( int failing_call = 3 ) : calls( 0 ), failing_call( failing_call ) {}
+
+    bool getNext( base::Time& ts, string& next )
+    {
+	if( ++calls == failing_call )
+	    throw std::runtime_error("decoding failed");
+	ts = base::Time::fromSeconds( calls );
+	next = "f";
+	return calls < 5;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( pull_prefetch_test )
+{
+    // the same data is merged with and without prefetch
+    const base::Time no_timeout;
+    vector<string> expected;
+    for( int prefetch = 0; prefetch < 2; prefetch++ )
+    {
+	pull_sequence p[8];
+	PullStreamAligner reader( no_timeout );
+	for( int i = 0; i < 8; i++ )
+	{
+	    for( int j = 0; j < 500; j++ )
+		p[i].add( (j * 8 + (i * 5) % 8) * 0.001, boost::lexical_cast<string>( i * 1000 + j ) );
+	    reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p[i], _1, _2 ), &pulled_callback, 0, base::Time(), i % 3 );
+	}
+	if( prefetch )
+	{
+	    reader.enablePrefetch( 4 );
+	    BOOST_CHECK( reader.isPrefetchEnabled() );
+	}
+
+	pulled.clear();
+	while( reader.pull() )
+	    while( reader.step() );
+	BOOST_CHECK_EQUAL( pulled.size(), 4000 );
+	if( prefetch )
+	    BOOST_CHECK_EQUAL_COLLECTIONS( pulled.begin(), pulled.end(), expected.begin(), expected.end() );
+	else
+	    expected = pulled;
+    }
+
+    // exceptions of the pull callbacks are rethrown by pull(), after the
+    // samples pulled before
+    pull_failure failing;
+    PullStreamAligner reader( no_timeout );
+    reader.registerStream<string>( boost::bind( &pull_failure::getNext, &failing, _1, _2 ), &pulled_callback, 0, base::Time() );
+    reader.enablePrefetch( 8 );
+    BOOST_CHECK( reader.pull() );
+    BOOST_CHECK( reader.pull() );
+    BOOST_CHECK_THROW( reader.pull(), std::runtime_error );
+    BOOST_CHECK( reader.pull() );
+    BOOST_CHECK( !reader.pull() );
+
+    reader.disablePrefetch();
+    BOOST_CHECK( !reader.isPrefetchEnabled() );
+    BOOST_CHECK( !reader.pull() );
+
+    // a failing stream does not lose the samples of the other streams
+    // pulled by the same call
+    for( int prefetch = 0; prefetch < 2; prefetch++ )
+    {
+	pull_sequence a, b;
+	for( int j = 0; j < 3; j++ )
+	{
+	    a.add( j + 0.5, "a" );
+	    b.add( j + 0.5, "b" );
+	}
+	pull_failure first_failing( 1 );
+	PullStreamAligner merger( no_timeout );
+	merger.registerStream<string>( boost::bind( &pull_sequence::getNext, &a, _1, _2 ), &pulled_callback, 0, base::Time() );
+	merger.registerStream<string>( boost::bind( &pull_failure::getNext, &first_failing, _1, _2 ), &pulled_callback, 0, base::Time() );
+	merger.registerStream<string>( boost::bind( &pull_sequence::getNext, &b, _1, _2 ), &pulled_callback, 0, base::Time() );
+	if( prefetch )
+	    merger.enablePrefetch( 2 );
+
+	pulled.clear();
+	BOOST_CHECK_THROW( merger.pull(), std::runtime_error );
+	while( merger.pull() )
+	    while( merger.step() );
+	while( merger.step() );
+	const char* merged[] = { "a", "b", "a", "b", "f", "a", "b", "f", "f" };
+	BOOST_CHECK_EQUAL_COLLECTIONS( pulled.begin(), pulled.end(), merged, merged + 9 );
+    }
+
+    // once the prefetch is stopped, the stream is pulled with the
+    // callback given by copyState
+    pull_sequence empty, copied_source;
+    copied_source.add( 1.0, "copied" );
+    PullStreamAligner prefetched( no_timeout ), copied( no_timeout );
+    prefetched.registerStream<string>( boost::bind( &pull_sequence::getNext, &empty, _1, _2 ), &pulled_callback, 0, base::Time() );
+    copied.registerStream<string>( boost::bind( &pull_sequence::getNext, &copied_source, _1, _2 ), &pulled_callback, 0, base::Time() );
+    prefetched.enablePrefetch( 2 );
+    prefetched.disablePrefetch();
+    prefetched.copyState( copied );
+    BOOST_CHECK( prefetched.pull() );
+}
+
+BOOST_AUTO_TEST_CASE( pull_direct_dispatch_test )
+{
+    // direct dispatch plays out the samples in the order of step(),
+    // including equal times on streams of different priorities and
+    // samples which arrive too late
+    const base::Time no_timeout;
+    vector<string> expected;
+    for( int mode = 0; mode < 3; mode++ )
+    {
+	pull_sequence p[5];
+	PullStreamAligner reader( no_timeout );
+	for( int i = 0; i < 5; i++ )
+	{
+	    for( int j = 0; j < 200; j++ )
+		p[i].add( (j / 2 * 4 + i % 3) * 0.001, boost::lexical_cast<string>( i * 1000 + j ) );
+	    reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p[i], _1, _2 ), &pulled_callback, 0, base::Time(), (7 - i) % 3 );
+	}
+	p[2].add( 0.0, "late" );
+	p[2].add( 1.0, "last" );
+	if( mode > 0 )
+	    reader.setDirectDispatch( true );
+	if( mode > 1 )
+	    reader.enablePrefetch( 3 );
+
+	pulled.clear();
+	while( reader.pull() )
+	    while( reader.step() );
+	BOOST_CHECK_EQUAL( pulled.size(), 1001 );
+	BOOST_CHECK_EQUAL( reader.getStatus().streams[2].samples_dropped_late_arriving, 1 );
+	BOOST_CHECK_EQUAL( reader.getStatus().streams[2].samples_processed, 201 );
+	BOOST_CHECK_EQUAL( reader.getCurrentTime().toSeconds(), 1.0 );
+	if( mode == 0 )
+	    expected = pulled;
+	else
+	    BOOST_CHECK_EQUAL_COLLECTIONS( pulled.begin(), pulled.end(), expected.begin(), expected.end() );
+    }
+
+    // direct dispatch cannot overtake buffered samples
+    PullStreamAligner reader;
+    pull_sequence p;
+    int idx = reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p, _1, _2 ), &pulled_callback, 0, base::Time() );
+    reader.push( idx, base::Time::fromSeconds( 1.0 ), string("buffered") );
+    BOOST_CHECK_THROW( reader.setDirectDispatch( true ), std::runtime_error );
+    BOOST_CHECK( !reader.isDirectDispatch() );
+}
+
+BOOST_AUTO_TEST_CASE( pull_seek_test )
+{
+    for( int prefetch = 0; prefetch < 2; prefetch++ )
+    {
+	pull_sequence p[3];
+	PullStreamAligner reader( base::Time::fromSeconds( 0.5 ) );
+	for( int i = 0; i < 3; i++ )
+	{
+	    for( int j = 0; j < 100; j++ )
+		p[i].add( j * 0.1 + i * 0.01, boost::lexical_cast<string>( i * 1000 + j ) );
+	}
+	// the last source cannot seek, and gets pulled up to the seek time
+	reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p[0], _1, _2 ), &pulled_callback, 0, base::Time(), 0,
+		boost::bind( &pull_sequence::seek, &p[0], _1 ) );
+	reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p[1], _1, _2 ), &pulled_callback, 0, base::Time(), 1,
+		boost::bind( &pull_sequence::seek, &p[1], _1 ) );
+	reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p[2], _1, _2 ), &pulled_callback, 0, base::Time(), 2 );
+	if( prefetch )
+	    reader.enablePrefetch( 4 );
+
+	// start the replay, then jump into the middle
+	pulled.clear();
+	for( int i = 0; i < 10; i++ )
+	    reader.pull();
+	while( reader.step() );
+
+	reader.seek( base::Time::fromSeconds( 5.0 ) );
+	BOOST_CHECK_EQUAL( p[0].seeks, 1 );
+	BOOST_CHECK( reader.getCurrentTime() == base::Time() );
+
+	pulled.clear();
+	while( reader.pull() )
+	    while( reader.step() );
+	reader.setTimeout( base::Time() );
+	while( reader.step() );
+
+	BOOST_REQUIRE_EQUAL( pulled.size(), 150 );
+	BOOST_CHECK_EQUAL( pulled.front(), "50" );
+	BOOST_CHECK_EQUAL( pulled[1], "1050" );
+	BOOST_CHECK_EQUAL( pulled[2], "2050" );
+	BOOST_CHECK_EQUAL( pulled.back(), "2099" );
+
+	// seeking back after the end of all sources. The source without
+	// seek callback stays at its end
+	reader.setTimeout( base::Time::fromSeconds( 0.5 ) );
+	reader.seek( base::Time::fromSeconds( 0.15 ) );
+	pulled.clear();
+	BOOST_CHECK( reader.pull() );
+	BOOST_CHECK( reader.pull() );
+	BOOST_CHECK( reader.pull() );
+	BOOST_CHECK( reader.pull() );
+	reader.setTimeout( base::Time() );
+	while( reader.step() );
+	BOOST_REQUIRE_EQUAL( pulled.size(), 4 );
+	BOOST_CHECK_EQUAL( pulled[0], "2" );
+	BOOST_CHECK_EQUAL( pulled[1], "1002" );
+	BOOST_CHECK_EQUAL( pulled[2], "3" );
+	BOOST_CHECK_EQUAL( pulled[3], "1003" );
+    }
+
+    // a seek into the samples already pulled from sources without seek
+    // callback keeps these samples
+    for( int prefetch = 0; prefetch < 2; prefetch++ )
+    {
+	pull_sequence p[2];
+	PullStreamAligner reader( base::Time::fromSeconds( 0.5 ) );
+	for( int i = 0; i < 2; i++ )
+	{
+	    for( int j = 0; j < 5; j++ )
+		p[i].add( j, boost::lexical_cast<string>( i * 1000 + j ) );
+	    reader.registerStream<string>( boost::bind( &pull_sequence::getNext, &p[i], _1, _2 ), &pulled_callback, 0, base::Time() );
+	}
+	if( prefetch )
+	    reader.enablePrefetch( 4 );
+
+	// pushes 0, 1000 and 1, and holds 1001
+	for( int i = 0; i < 3; i++ )
+	    BOOST_CHECK( reader.pull() );
+	reader.seek( base::Time::fromSeconds( 1.0 ) );
+
+	pulled.clear();
+	while( reader.pull() )
+	    while( reader.step() );
+	reader.setTimeout( base::Time() );
+	while( reader.step() );
+
+	const char* expected[] = { "1001", "2", "1002", "3", "1003", "4", "1004" };
+	BOOST_CHECK_EQUAL_COLLECTIONS( pulled.begin(), pulled.end(), expected, expected + 7 );
+    }
+}
+
+vector<string> replayed;
+
+void record_callback( const base::Time &time, const string& sample )
+{
+    replayed.push_back( sample );
+}
+
+BOOST_AUTO_TEST_CASE( priority_order_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    // callback, buffer_size, period_time, (optional) priority
+    int s1 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(1), 2 ); 
+    int s2 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(1), 1 ); 
+    int s3 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(0.5), 1 ); 
+    int s4 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(1), 0 ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("d") ); 
+    reader.push( s3, base::Time::fromSeconds(1.0), string("c") ); 
+    reader.push( s2, base::Time::fromSeconds(1.0), string("b") ); 
+    reader.push( s4, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s4, base::Time::fromSeconds(2.0), string("e") ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("g") ); 
+    reader.push( s2, base::Time::fromSeconds(2.0), string("f") ); 
+
+    // s3 is still expected to deliver data at 1.5, and the timeout has
+    // not been reached yet
+    replayed.clear();
+    while( reader.step() );
+    BOOST_REQUIRE_EQUAL( replayed.size(), 4 );
+    BOOST_CHECK_EQUAL( replayed[0], "a" );
+    BOOST_CHECK_EQUAL( replayed[1], "b" );
+    BOOST_CHECK_EQUAL( replayed[2], "c" );
+    BOOST_CHECK_EQUAL( replayed[3], "d" );
+
+    // equal timestamps of the lookahead and the data don't block
+    reader.push( s3, base::Time::fromSeconds(3.5), string("h") ); 
+    replayed.clear();
+    while( reader.step() );
+    BOOST_REQUIRE_EQUAL( replayed.size(), 3 );
+    BOOST_CHECK_EQUAL( replayed[0], "e" );
+    BOOST_CHECK_EQUAL( replayed[1], "f" );
+    BOOST_CHECK_EQUAL( replayed[2], "g" );
+
+    // removing the blocking streams releases the remaining data
+    reader.unregisterStream( s1 );
+    reader.unregisterStream( s2 );
+    reader.disableStream( s4 );
+    replayed.clear();
+    while( reader.step() );
+    BOOST_REQUIRE_EQUAL( replayed.size(), 1 );
+    BOOST_CHECK_EQUAL( replayed[0], "h" );
+}
+
+BOOST_AUTO_TEST_CASE( drain_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    // callback, buffer_size, period_time
+    int s1 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1,0) ); 
+    int s2 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1,0) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("c") ); 
+    reader.push( s1, base::Time::fromSeconds(3.0), string("e") ); 
+    reader.push( s2, base::Time::fromSeconds(1.5), string("b") ); 
+    reader.push( s2, base::Time::fromSeconds(2.5), string("d") ); 
+
+    // s2 is expected at 3.5, which is after e
+    replayed.clear();
+    std::pair<size_t, base::Time> result = reader.stepMany( 2 );
+    BOOST_CHECK_EQUAL( result.first, 2 );
+    BOOST_CHECK_EQUAL( result.second.toSeconds(), 1.5 );
+    BOOST_CHECK_EQUAL( replayed.size(), 2 );
+
+    result = reader.drain();
+    BOOST_CHECK_EQUAL( result.first, 3 );
+    BOOST_CHECK_EQUAL( result.second.toSeconds(), 3.0 );
+    BOOST_REQUIRE_EQUAL( replayed.size(), 5 );
+    BOOST_CHECK_EQUAL( replayed[4], "e" );
+
+    // s2 is missing, so the s1 samples are only released after the timeout
+    reader.push( s1, base::Time::fromSeconds(4.0), string("f") ); 
+    BOOST_CHECK_EQUAL( reader.drain().first, 0 );
+    reader.push( s1, base::Time::fromSeconds(5.0), string("g") ); 
+    result = reader.drain();
+    BOOST_CHECK_EQUAL( result.first, 1 );
+    BOOST_CHECK_EQUAL( result.second.toSeconds(), 4.0 );
+    BOOST_CHECK_EQUAL( replayed.back(), "f" );
+}
+
+BOOST_AUTO_TEST_CASE( reorder_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    int s1 = reader.registerStream<string>( &record_callback, 0, base::Time::fromSeconds(1) ); 
+    reader.setStreamReorderWindow( s1, base::Time::fromSeconds(1.5), 2 );
+
+    replayed.clear();
+    reader.push( s1, base::Time::fromSeconds(10.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(12.0), string("c") ); 
+    reader.push( s1, base::Time::fromSeconds(11.0), string("b") ); 
+    reader.push( s1, base::Time::fromSeconds(13.0), string("d") ); 
+    reader.push( s1, base::Time::fromSeconds(14.0), string("e") ); 
+    // would have to pass three samples
+    reader.push( s1, base::Time::fromSeconds(11.5), string("x") ); 
+    reader.push( s1, base::Time::fromSeconds(12.8), string("y") ); 
+    // within the window, but would have to pass y, d and e
+    reader.push( s1, base::Time::fromSeconds(12.5), string("v") ); 
+
+    reader.step();
+    reader.step();
+    // older than the current time
+    reader.push( s1, base::Time::fromSeconds(10.5), string("z") ); 
+
+    // without sample limit
+    reader.setStreamReorderWindow( s1, base::Time::fromSeconds(0.5) );
+    reader.push( s1, base::Time::fromSeconds(16.0), string("g") ); 
+    reader.push( s1, base::Time::fromSeconds(15.6), string("f") ); 
+    reader.push( s1, base::Time::fromSeconds(15.2), string("w") ); 
+    reader.drain();
+
+    const char* expected[] = { "a", "b", "c", "y", "d", "e", "f", "g" };
+    BOOST_CHECK_EQUAL_COLLECTIONS( replayed.begin(), replayed.end(), expected, expected + 8 );
+
+    StreamStatus status = reader.getBufferStatus( s1 );
+    BOOST_CHECK_EQUAL( status.samples_reordered, 3 );
+    BOOST_CHECK_EQUAL( status.samples_backward_in_time, 3 );
+    BOOST_CHECK_EQUAL( status.samples_dropped_late_arriving, 1 );
+    // the reordered samples do not move the latest sample time back
+    BOOST_CHECK( status.latest_sample_time == base::Time::fromSeconds(16.0) );
+
+    // a full buffer drops the oldest sample, which may be the reordered one
+    StreamAligner fixed; 
+    fixed.setTimeout( base::Time::fromSeconds(10.0) );
+    int s2 = fixed.registerStream<string>( &record_callback, 3, base::Time::fromSeconds(1) ); 
+    fixed.setStreamReorderWindow( s2, base::Time::fromSeconds(5.0) );
+    replayed.clear();
+    fixed.push( s2, base::Time::fromSeconds(5.0), string("e") ); 
+    fixed.push( s2, base::Time::fromSeconds(6.0), string("f") ); 
+    fixed.push( s2, base::Time::fromSeconds(7.0), string("g") ); 
+    fixed.push( s2, base::Time::fromSeconds(4.0), string("d") ); 
+    BOOST_CHECK( fixed.getBufferStatus( s2 ).earliest_data_time == base::Time::fromSeconds(5.0) );
+    fixed.push( s2, base::Time::fromSeconds(5.5), string("x") ); 
+    fixed.setTimeout( base::Time() );
+    fixed.drain();
+
+    const char* fixed_expected[] = { "x", "f", "g" };
+    BOOST_CHECK_EQUAL_COLLECTIONS( replayed.begin(), replayed.end(), fixed_expected, fixed_expected + 3 );
+    status = fixed.getBufferStatus( s2 );
+    BOOST_CHECK_EQUAL( status.samples_dropped_buffer_full, 2 );
+    BOOST_CHECK_EQUAL( status.samples_reordered, 1 );
+}
+
+BOOST_AUTO_TEST_CASE( stream_handle_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    StreamAligner::StreamHandle<string> s1 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(1) ); 
+    StreamAligner::StreamHandle<string> s2 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(1) ); 
+    BOOST_CHECK_EQUAL( s1.getIndex(), 0 );
+    BOOST_CHECK_EQUAL( s2, 1 );
+
+    s1.push( base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(1.5), string("b") ); 
+    reader.push( 0, base::Time::fromSeconds(2.0), string("c") ); 
+
+    std::pair<base::Time, string> sample;
+    BOOST_REQUIRE( s2.getNextSample( sample ) );
+    BOOST_CHECK_EQUAL( sample.second, "b" );
+
+    replayed.clear();
+    while( reader.step() );
+    BOOST_REQUIRE_EQUAL( replayed.size(), 3 );
+    BOOST_CHECK_EQUAL( replayed[0], "a" );
+    BOOST_CHECK_EQUAL( replayed[1], "b" );
+    BOOST_CHECK_EQUAL( replayed[2], "c" );
+
+    BOOST_CHECK( s1.isValid() );
+    reader.unregisterStream( s1 );
+    BOOST_CHECK( !s1.isValid() );
+
+    // the slot gets reused, but the old handle stays invalid
+    StreamAligner::StreamHandle<string> s3 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(1) ); 
+    BOOST_CHECK_EQUAL( s3.getIndex(), s1.getIndex() );
+    BOOST_CHECK( s3.isValid() );
+    BOOST_CHECK( !s1.isValid() );
+}
+
+struct copy_counter
+{
+    static int copies;
+    string value;
+
+    copy_counter() {}
+    explicit copy_counter( const string& value ) : value( value ) {}
+    copy_counter( const copy_counter& other ) : value( other.value ) { copies++; }
+    copy_counter( copy_counter&& other ) noexcept : value( std::move(other.value) ) {}
+    copy_counter& operator=( const copy_counter& other ) { value = other.value; copies++; return *this; }
+    copy_counter& operator=( copy_counter&& other ) noexcept { value = std::move(other.value); return *this; }
+};
+int copy_counter::copies = 0;
+
+vector<copy_counter> moved_samples;
+
+void move_callback( const base::Time &time, copy_counter&& sample )
+{
+    moved_samples.push_back( std::move(sample) );
+}
+
+BOOST_AUTO_TEST_CASE( move_push_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    StreamAligner::StreamHandle<copy_counter> s1 = 
+	reader.registerStream<copy_counter>( StreamAligner::Stream<copy_counter>::callback_t(), 0, base::Time::fromSeconds(1) ); 
+    reader.setMoveCallback( s1, &move_callback );
+
+    copy_counter::copies = 0;
+    moved_samples.clear();
+    copy_counter a( "a" );
+    reader.push( s1, base::Time::fromSeconds(1.0), std::move(a) ); 
+    reader.push( s1.getIndex(), base::Time::fromSeconds(2.0), copy_counter( "b" ) ); 
+    reader.emplace( s1, base::Time::fromSeconds(3.0), string("c") ); 
+    reader.emplace<copy_counter>( s1.getIndex(), base::Time::fromSeconds(4.0), string("d") ); 
+    for( int i = 0; i < 50; i++ )
+	s1.emplace( base::Time::fromSeconds(5.0 + i), string("e") );
+
+    reader.drain();
+    BOOST_CHECK_EQUAL( copy_counter::copies, 0 );
+    BOOST_REQUIRE_EQUAL( moved_samples.size(), 54 );
+    BOOST_CHECK_EQUAL( moved_samples[0].value, "a" );
+    BOOST_CHECK_EQUAL( moved_samples[1].value, "b" );
+    BOOST_CHECK_EQUAL( moved_samples[2].value, "c" );
+    BOOST_CHECK_EQUAL( moved_samples[3].value, "d" );
+
+    // pushing a const reference still copies once
+    const copy_counter f( "f" );
+    s1.push( base::Time::fromSeconds(60.0), f );
+    BOOST_CHECK_EQUAL( copy_counter::copies, 1 );
+}
+
+BOOST_AUTO_TEST_CASE( dynamic_buffer_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    StreamAligner::StreamHandle<copy_counter> s1 = 
+	reader.registerStream<copy_counter>( StreamAligner::Stream<copy_counter>::callback_t(), 0, base::Time::fromSeconds(1) ); 
+    int s2 = reader.registerStream<string>( &record_callback, 0, base::Time::fromSeconds(1) ); 
+    reader.setMoveCallback( s1, &move_callback );
+
+    copy_counter::copies = 0;
+    moved_samples.clear();
+    for( int i = 0; i < 1000; i++ )
+	s1.emplace( base::Time::fromSeconds(1.0 + i), string("a") );
+
+    // growing the buffer did not copy any sample
+    BOOST_CHECK_EQUAL( copy_counter::copies, 0 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).buffer_fill, 1000 );
+    BOOST_CHECK( reader.getBufferStatus( s1 ).buffer_size >= 1000 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).samples_dropped_buffer_full, 0 );
+
+    // s2 only blocks the last sample, until the timeout
+    reader.push( s2, base::Time::fromSeconds(997.5), string("b") ); 
+    reader.drain();
+    BOOST_CHECK_EQUAL( moved_samples.size(), 999 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).buffer_fill, 1 );
+
+    // the drained chunks have been given back
+    BOOST_CHECK( reader.getBufferStatus( s1 ).buffer_size < 1000 );
+    BOOST_CHECK_EQUAL( copy_counter::copies, 0 );
+}
+
+struct alignas(64) aligned_sample
+{
+    double value[8];
+};
+
+BOOST_AUTO_TEST_CASE( aligned_buffer_test )
+{
+    ChunkPool pool;
+    ChunkedBuffer<aligned_sample> buffer( pool );
+    ChunkedBuffer<double> small( pool );
+    for( int i = 0; i < 200; i++ )
+    {
+	small.emplace_back( i );
+	buffer.emplace_back();
+	BOOST_REQUIRE_EQUAL( reinterpret_cast<uintptr_t>( &buffer.back() ) % 64, 0 );
+    }
+    while( !buffer.empty() )
+	buffer.pop_front();
+    pool.trim( 0 );
+    BOOST_CHECK_EQUAL( pool.getFreeBytes(), 0 );
+    BOOST_CHECK_EQUAL( pool.getAllocatedBytes(), pool.getUsedBytes() );
+}
+
+BOOST_AUTO_TEST_CASE( shrink_policy_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+    reader.setShrinkPolicy( StreamAligner::ShrinkPolicy( 0.5, base::Time::fromSeconds(10) ) );
+
+    int s1 = reader.registerStream<string>( &record_callback, 0, base::Time::fromSeconds(0.01) ); 
+
+    // burst
+    double t = 0;
+    for( int i = 0; i < 10000; i++ )
+	reader.push( s1, base::Time::fromSeconds(t += 0.01), string("a") ); 
+    reader.drain();
+
+    const size_t peak = reader.getStatus().buffer_bytes_allocated;
+    BOOST_CHECK_EQUAL( reader.getStatus().buffer_bytes_reclaimed, 0 );
+
+    // steady state, the memory is only released after the window
+    for( int i = 0; i < 500; i++ )
+    {
+	reader.push( s1, base::Time::fromSeconds(t += 0.01), string("a") ); 
+	reader.drain();
+    }
+    BOOST_CHECK_EQUAL( reader.getStatus().buffer_bytes_allocated, peak );
+
+    for( int i = 0; i < 1000; i++ )
+    {
+	reader.push( s1, base::Time::fromSeconds(t += 0.01), string("a") ); 
+	reader.drain();
+    }
+    const StreamAlignerStatus &status( reader.getStatus() );
+    BOOST_CHECK( status.buffer_bytes_allocated < peak / 10 );
+    BOOST_CHECK_EQUAL( status.buffer_bytes_allocated + status.buffer_bytes_reclaimed, peak );
+
+    // an idle aligner only gives the memory back on request
+    for( int i = 0; i < 10000; i++ )
+	reader.push( s1, base::Time::fromSeconds(t += 0.01), string("a") ); 
+    reader.drain();
+    BOOST_CHECK( reader.trimMemory() > 0 );
+    BOOST_CHECK( reader.getStatus().buffer_bytes_allocated < peak / 10 );
+
+    BOOST_CHECK_THROW( reader.setShrinkPolicy( StreamAligner::ShrinkPolicy( 1.0, base::Time() ) ), std::runtime_error );
+}
+
+BOOST_AUTO_TEST_CASE( memory_budget_test )
+{
+    typedef vector<char> blob;
+    const size_t sample_bytes = sizeof(base::Time) + SampleSize<blob>::get( blob(1000) );
+
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+    reader.setMemoryBudget( 4 * sample_bytes, StreamAligner::DROP_OLDEST );
+
+    int s1 = reader.registerStream<blob>( StreamAligner::Stream<blob>::callback_t(), 0, base::Time::fromSeconds(1), 0 ); 
+    int s2 = reader.registerStream<blob>( StreamAligner::Stream<blob>::callback_t(), 0, base::Time::fromSeconds(1), 1 ); 
+    reader.registerStream<blob>( StreamAligner::Stream<blob>::callback_t(), 0, base::Time::fromSeconds(1), 2 ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), blob(1000) ); 
+    reader.push( s2, base::Time::fromSeconds(1.5), blob(1000) ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), blob(1000) ); 
+    reader.push( s2, base::Time::fromSeconds(2.5), blob(1000) ); 
+    BOOST_CHECK_EQUAL( reader.getBufferedBytes(), 4 * sample_bytes );
+
+    // the oldest sample, on s1, gets dropped
+    reader.push( s2, base::Time::fromSeconds(3.5), blob(1000) ); 
+    BOOST_CHECK_EQUAL( reader.getBufferedBytes(), 4 * sample_bytes );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).samples_dropped_memory_budget, 1 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).buffer_fill, 1 );
+    BOOST_CHECK_EQUAL( reader.getStatus().samples_dropped_memory_budget, 1 );
+
+    // now s2 has the lowest priority
+    reader.setMemoryBudget( 4 * sample_bytes, StreamAligner::DROP_LOWEST_PRIORITY );
+    reader.push( s1, base::Time::fromSeconds(4.0), blob(1000) ); 
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).buffer_fill, 2 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s2 ).buffer_fill, 2 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s2 ).samples_dropped_memory_budget, 1 );
+
+    // and the oldest sample gets played out, even though the third stream
+    // did not time out yet
+    reader.setMemoryBudget( 4 * sample_bytes, StreamAligner::FORCE_TIMEOUT );
+    reader.push( s1, base::Time::fromSeconds(5.0), blob(1000) ); 
+    BOOST_CHECK_EQUAL( reader.getCurrentTime().toSeconds(), 2.0 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).samples_released_memory_budget, 1 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).samples_processed, 1 );
+    BOOST_CHECK_EQUAL( reader.getStatus().samples_released_memory_budget, 1 );
+    BOOST_CHECK_EQUAL( reader.getBufferedBytes(), 4 * sample_bytes );
+}
+
+BOOST_AUTO_TEST_CASE( wait_deadline_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    int s1 = reader.registerStream<string>( &record_callback, 5, base::Time::fromSeconds(1) ); 
+    int s2 = reader.registerStream<string>( &record_callback, 5, base::Time::fromSeconds(1) ); 
+
+    StreamAligner::WaitDeadline deadline = reader.getWaitDeadline();
+    BOOST_CHECK( !deadline.releasable );
+    BOOST_CHECK_EQUAL( deadline.blocking_stream, -1 );
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(1.5), string("b") ); 
+    BOOST_CHECK( reader.getWaitDeadline().releasable );
+
+    reader.drain();
+    reader.push( s1, base::Time::fromSeconds(2.0), string("c") ); 
+    reader.push( s1, base::Time::fromSeconds(3.0), string("d") ); 
+    reader.drain();
+
+    // d is waiting for s2, which should deliver at 2.5
+    BOOST_CHECK_EQUAL( replayed.back(), "c" );
+    deadline = reader.getWaitDeadline();
+    BOOST_CHECK( !deadline.releasable );
+    BOOST_CHECK_EQUAL( deadline.blocking_stream, s2 );
+    BOOST_CHECK_EQUAL( deadline.expected_time.toSeconds(), 2.5 );
+    BOOST_CHECK_EQUAL( deadline.timeout_time.toSeconds(), 4.0 );
+
+    reader.push( s1, base::Time::fromSeconds(3.9), string("e") ); 
+    BOOST_CHECK( !reader.getWaitDeadline().releasable );
+    reader.push( s1, base::Time::fromSeconds(4.0), string("f") ); 
+    BOOST_CHECK( reader.getWaitDeadline().releasable );
+    BOOST_CHECK( reader.step() );
+    BOOST_CHECK_EQUAL( replayed.back(), "d" );
+}
+
+BOOST_AUTO_TEST_CASE( wall_clock_timeout_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+    reader.setWallClockTimeout( base::Time::fromMilliseconds(50) );
+
+    int s1 = reader.registerStream<string>( &record_callback, 5, base::Time::fromSeconds(1) ); 
+    reader.registerStream<string>( &record_callback, 5, base::Time::fromSeconds(0.5) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(1.1), string("b") ); 
+
+    // s2 blocks, and no data comes in to trigger the data timeout
+    replayed.clear();
+    BOOST_CHECK( !reader.step() );
+    StreamAligner::WaitDeadline deadline = reader.getWaitDeadline();
+    BOOST_CHECK( !deadline.releasable );
+    BOOST_CHECK( deadline.wall_timeout_time > StreamAligner::getMonotonicTime() );
+
+    std::this_thread::sleep_for( std::chrono::milliseconds(60) );
+    BOOST_CHECK( reader.getWaitDeadline().releasable );
+    reader.drain();
+    BOOST_REQUIRE_EQUAL( replayed.size(), 2 );
+    BOOST_CHECK_EQUAL( replayed[0], "a" );
+    BOOST_CHECK_EQUAL( replayed[1], "b" );
+}
+
+BOOST_AUTO_TEST_CASE( stream_timeout_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    // the imu only waits 0.1 seconds for the gps
+    int imu = reader.registerStream<string>( &record_callback, -1, base::Time::fromSeconds(0.01), -1, "imu", base::Time::fromSeconds(0.1) ); 
+    int gps = reader.registerStream<string>( &record_callback, -1, base::Time::fromSeconds(1.0), -1, "gps" ); 
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( imu ).buffer_size, 20 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( gps ).buffer_size, 4 );
+    BOOST_CHECK_EQUAL( reader.getStreamTimeout( imu ).toSeconds(), 0.1 );
+    BOOST_CHECK_EQUAL( reader.getStreamTimeout( gps ).toSeconds(), 2.0 );
+
+    reader.push( gps, base::Time::fromSeconds(1.0), string("g1") ); 
+
+    // the gps is expected at 2.0, the imu samples after that are only
+    // released once the imu timeout has passed
+    replayed.clear();
+    for( int i = 100; i <= 215; i++ )
+    {
+	reader.push( imu, base::Time::fromMicroseconds(i * 10000), string("i") ); 
+	reader.drain();
+    }
+    BOOST_CHECK_EQUAL( replayed.size(), 1 + 107 );
+    BOOST_CHECK_EQUAL( reader.getCurrentTime().toMicroseconds(), 2060000 );
+
+    // with the default timeout, the imu waits for the gps
+    reader.setStreamTimeout( imu, base::Time() );
+    reader.push( imu, base::Time::fromSeconds(2.16), string("i") ); 
+    BOOST_CHECK_EQUAL( reader.drain().first, 0 );
+
+    // but not if the gps is not expected anymore
+    reader.setStreamLookahead( gps, base::Time::fromSeconds(10.0) );
+    BOOST_CHECK_EQUAL( reader.drain().first, 10 );
+}
+
+vector<base::Time> ingested;
+
+void ingest_callback( const base::Time &time, const int& sample )
+{
+    ingested.push_back( time );
+}
+
+BOOST_AUTO_TEST_CASE( concurrent_ingest_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(10.0) );
+
+    const int producers = 4;
+    const int samples = 10000;
+    vector< StreamAligner::StreamHandle<int> > handles;
+    for( int i = 0; i < producers; i++ )
+    {
+	handles.push_back( reader.registerStream<int>( &ingest_callback, 0, base::Time() ) ); 
+	reader.enableConcurrentIngest( handles.back(), 64 );
+    }
+
+    ingested.clear();
+    vector<std::thread> threads;
+    for( int i = 0; i < producers; i++ )
+    {
+	StreamAligner::StreamHandle<int> handle = handles[i];
+	threads.push_back( std::thread( [handle, i, samples]() mutable
+	{
+	    for( int j = 1; j <= samples; j++ )
+	    {
+		handle.push( base::Time::fromMicroseconds( j * producers + i ), j );
+		if( j % 32 == 0 )
+		    std::this_thread::yield();
+	    }
+	} ) );
+    }
+
+    // samples overflowing the ingest queues are dropped, but everything
+    // else has to come out in order
+    size_t accounted = 0;
+    while( accounted < producers * samples )
+    {
+	reader.drain();
+	accounted = 0;
+	for( int i = 0; i < producers; i++ )
+	{
+	    const StreamStatus &status( reader.getBufferStatus( handles[i] ) );
+	    accounted += status.samples_received;
+	    BOOST_CHECK_EQUAL( status.samples_received, status.samples_processed + status.buffer_fill 
+		    + status.samples_dropped_late_arriving + status.samples_dropped_ingest_full );
+	}
+    }
+    for( size_t i = 0; i < threads.size(); i++ )
+	threads[i].join();
+
+    BOOST_CHECK( !ingested.empty() );
+    for( size_t i = 1; i < ingested.size(); i++ )
+	BOOST_REQUIRE( ingested[i-1] <= ingested[i] );
+
+    // a full queue drops the newest samples
+    StreamAligner::StreamHandle<int> single = reader.registerStream<int>( &ingest_callback, 0, base::Time() ); 
+    reader.enableConcurrentIngest( single, 2 );
+    for( int i = 0; i < producers; i++ )
+	reader.disableStream( handles[i] );
+    reader.clear();
+    ingested.clear();
+    single.push( base::Time::fromSeconds(1.0), 1 );
+    single.push( base::Time::fromSeconds(2.0), 2 );
+    single.push( base::Time::fromSeconds(3.0), 3 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( single ).buffer_fill, 0 );
+    reader.ingest();
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( single ).buffer_fill, 2 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( single ).samples_dropped_ingest_full, 1 );
+    BOOST_CHECK_EQUAL( reader.drain().first, 2 );
+    BOOST_CHECK( ingested.back() == base::Time::fromSeconds(2.0) );
+
+    // clear() discards the samples which are still queued
+    single.push( base::Time::fromSeconds(4.0), 4 );
+    reader.clear();
+    reader.ingest();
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( single ).buffer_fill, 0 );
+    single.push( base::Time::fromSeconds(1.0), 1 );
+    reader.ingest();
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( single ).buffer_fill, 1 );
+}
+
+BOOST_AUTO_TEST_CASE( static_aligner_test )
+{
+    // same scenario as priority_order_test
+    auto reader = makeStaticStreamAligner( base::Time::fromSeconds(2.0),
+	    makeStaticStream<string>( &record_callback, 4, base::Time::fromSeconds(1), 2 ),
+	    makeStaticStream<string>( &record_callback, 4, base::Time::fromSeconds(1), 1 ),
+	    makeStaticStream<string>( &record_callback, 4, base::Time::fromSeconds(0.5), 1 ),
+	    makeStaticStream<string>( &record_callback, 4, base::Time::fromSeconds(1), 0 ) );
+
+    reader.push<0>( base::Time::fromSeconds(1.0), "d" ); 
+    reader.push<2>( base::Time::fromSeconds(1.0), "c" ); 
+    reader.push<1>( base::Time::fromSeconds(1.0), "b" ); 
+    reader.push<3>( base::Time::fromSeconds(1.0), "a" ); 
+    reader.push<3>( base::Time::fromSeconds(2.0), "e" ); 
+    reader.push<0>( base::Time::fromSeconds(2.0), "g" ); 
+    reader.push<1>( base::Time::fromSeconds(2.0), "f" ); 
+
+    replayed.clear();
+    BOOST_CHECK_EQUAL( reader.drain().first, 4 );
+    BOOST_REQUIRE_EQUAL( replayed.size(), 4 );
+    BOOST_CHECK_EQUAL( replayed[0], "a" );
+    BOOST_CHECK_EQUAL( replayed[3], "d" );
+
+    reader.push<2>( base::Time::fromSeconds(3.5), "h" ); 
+    replayed.clear();
+    BOOST_CHECK_EQUAL( reader.drain().first, 3 );
+    BOOST_REQUIRE_EQUAL( replayed.size(), 3 );
+    BOOST_CHECK_EQUAL( replayed[0], "e" );
+    BOOST_CHECK_EQUAL( replayed[1], "f" );
+    BOOST_CHECK_EQUAL( replayed[2], "g" );
+
+    reader.disableStream<0>();
+    reader.disableStream<1>();
+    reader.disableStream<3>();
+    BOOST_CHECK( reader.step() );
+    BOOST_CHECK_EQUAL( replayed.back(), "h" );
+
+    // late samples are dropped
+    reader.push<0>( base::Time::fromSeconds(3.0), "i" ); 
+    BOOST_CHECK_EQUAL( reader.getBufferStatus<0>().samples_dropped_late_arriving, 1 );
+    BOOST_CHECK_EQUAL( reader.getSamplesDroppedLateArriving(), 1 );
+
+    // negative sizes are computed from the period and the timeout
+    auto sized = makeStaticStreamAligner( base::Time::fromSeconds(2.0),
+	    makeStaticStream<string>( &record_callback, -1, base::Time::fromSeconds(0.1) ),
+	    makeStaticStream<string>( &record_callback, 0, base::Time() ) );
+    BOOST_CHECK_EQUAL( sized.getBufferStatus<0>().buffer_size, 40 );
+    for( int i = 0; i < 100; i++ )
+	sized.push<1>( base::Time::fromSeconds(i), "j" ); 
+    BOOST_CHECK_EQUAL( sized.getBufferStatus<1>().buffer_fill, 100 );
+    BOOST_CHECK_THROW( makeStaticStreamAligner( base::Time::fromSeconds(2.0),
+		makeStaticStream<string>( &record_callback, -1, base::Time() ) ), std::runtime_error );
+}
+
+BOOST_AUTO_TEST_CASE( static_aligner_equivalence_test )
+{
+    // feed the same pseudo random data to a StreamAligner and a
+    // StaticStreamAligner, and compare the release order
+    StreamAligner dynamic_reader; 
+    dynamic_reader.setTimeout( base::Time::fromSeconds(0.5) );
+    int s1 = dynamic_reader.registerStream<string>( &record_callback, 8, base::Time::fromSeconds(0.1) ); 
+    int s2 = dynamic_reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(0.3), 1 ); 
+    int s3 = dynamic_reader.registerStream<string>( &record_callback, 0, base::Time(), 0 ); 
+
+    vector<string> static_replayed;
+    auto static_callback = [&static_replayed]( const base::Time &ts, const string &sample ) { static_replayed.push_back( sample ); };
+    auto static_reader = makeStaticStreamAligner( base::Time::fromSeconds(0.5),
+	    makeStaticStream<string>( static_callback, 8, base::Time::fromSeconds(0.1) ),
+	    makeStaticStream<string>( static_callback, 4, base::Time::fromSeconds(0.3), 1 ),
+	    makeStaticStream<string>( static_callback, 0, base::Time(), 0 ) );
+
+    replayed.clear();
+    int64_t ts[3] = { 0, 0, 0 };
+    unsigned seed = 42;
+    for( int i = 0; i < 2000; i++ )
+    {
+	seed = seed * 1103515245 + 12345;
+	int stream = (seed >> 16) % 3;
+	ts[stream] += 10000 + (seed >> 8) % 200000;
+	const base::Time time = base::Time::fromMicroseconds( ts[stream] - (seed % 50000) );
+	const string sample = std::to_string( i );
+	if( stream == 0 )
+	{
+	    dynamic_reader.push( s1, time, sample );
+	    static_reader.push<0>( time, sample );
+	}
+	else if( stream == 1 )
+	{
+	    dynamic_reader.push( s2, time, sample );
+	    static_reader.push<1>( time, sample );
+	}
+	else
+	{
+	    dynamic_reader.push( s3, time, sample );
+	    static_reader.push<2>( time, sample );
+	}
+
+	if( seed % 3 )
+	{
+	    BOOST_REQUIRE_EQUAL( dynamic_reader.step(), static_reader.step() );
+	}
+    }
+    dynamic_reader.drain();
+    static_reader.drain();
+    BOOST_CHECK( replayed == static_replayed );
+    BOOST_CHECK( dynamic_reader.getCurrentTime() == static_reader.getCurrentTime() );
+}
+
+BOOST_AUTO_TEST_CASE( next_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    int s1 = reader.registerStream<string>( &record_callback, 4, base::Time::fromSeconds(1) ); 
+    int s2 = reader.registerStream<int>( &ingest_callback, 4, base::Time::fromSeconds(1) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(1.5), 2 ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("c") ); 
+
+    replayed.clear();
+    ingested.clear();
+    StreamAligner::AlignedSample sample;
+    BOOST_REQUIRE( reader.next( sample ) );
+    BOOST_CHECK_EQUAL( sample.getStreamIndex(), s1 );
+    BOOST_CHECK_EQUAL( sample.getTime().toSeconds(), 1.0 );
+    BOOST_CHECK( sample.is<string>() );
+    BOOST_CHECK( !sample.is<int>() );
+    BOOST_CHECK_EQUAL( sample.get<string>(), "a" );
+    BOOST_CHECK_THROW( sample.get<int>(), std::bad_cast );
+    BOOST_CHECK_EQUAL( reader.getCurrentTime().toSeconds(), 1.0 );
+
+    BOOST_REQUIRE( reader.next( sample ) );
+    BOOST_CHECK_EQUAL( sample.getStreamIndex(), s2 );
+    BOOST_CHECK_EQUAL( sample.get<int>(), 2 );
+
+    // pushing removes the sample handed out last
+    reader.push( s2, base::Time::fromSeconds(2.5), 4 ); 
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s2 ).buffer_fill, 1 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s2 ).samples_processed, 1 );
+
+    BOOST_REQUIRE( reader.next( sample ) );
+    BOOST_CHECK_EQUAL( sample.take<string>(), "c" );
+
+    // s1 is expected at 3.0, so 2.5 can be released
+    BOOST_REQUIRE( reader.next( sample ) );
+    BOOST_CHECK_EQUAL( sample.get<int>(), 4 );
+    BOOST_CHECK( !reader.next( sample ) );
+    BOOST_CHECK_EQUAL( sample.getStreamIndex(), -1 );
+
+    // the callbacks are not called for samples returned by next
+    BOOST_CHECK( replayed.empty() );
+    BOOST_CHECK( ingested.empty() );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).samples_processed, 2 );
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s2 ).samples_processed, 2 );
+    BOOST_CHECK_EQUAL( reader.getBufferedBytes(), 0 );
+
+    // the footprint of samples taken out by the consumer is still
+    // accounted for when they get removed
+    StreamAligner vector_reader( base::Time::fromSeconds(2.0) );
+    StreamAligner::StreamHandle< vector<char> > v1 = 
+	vector_reader.registerStream< vector<char> >( StreamAligner::Stream< vector<char> >::callback_t(), 0, base::Time() ); 
+    for( int i = 0; i < 3; i++ )
+    {
+	v1.push( base::Time::fromSeconds(i), vector<char>( 10000 ) );
+	BOOST_REQUIRE( vector_reader.next( sample ) );
+	BOOST_CHECK_EQUAL( sample.take< vector<char> >().size(), 10000 );
+    }
+    BOOST_CHECK( !vector_reader.next( sample ) );
+    BOOST_CHECK_EQUAL( vector_reader.getBufferedBytes(), 0 );
+    BOOST_CHECK_EQUAL( vector_reader.getBufferStatus( v1 ).buffer_bytes, 0 );
+}
+
+vector<string> synchronized;
+
+void sync_callback( const base::Time &ts, const StreamAligner::MatchedSamples &samples )
+{
+    string match = samples.get<string>( 0 );
+    for( size_t i = 1; i < samples.size(); i++ )
+	match += "/" + boost::lexical_cast<string>( samples.get<int>( i ) );
+    synchronized.push_back( match );
+}
+
+BOOST_AUTO_TEST_CASE( synchronizer_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    int s1 = reader.registerStream<string>( &test_callback, 0, base::Time::fromSeconds(1) ); 
+    int s2 = reader.registerStream<int>( &ingest_callback, 0, base::Time::fromSeconds(1) ); 
+
+    std::vector<int> sync_streams;
+    sync_streams.push_back( s1 );
+    BOOST_CHECK_THROW( reader.addSynchronizer( sync_streams, base::Time::fromSeconds(0.2), &sync_callback ), std::runtime_error );
+    sync_streams.push_back( s2 );
+    int sync = reader.addSynchronizer( sync_streams, base::Time::fromSeconds(0.2), &sync_callback );
+
+    synchronized.clear();
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s2, base::Time::fromSeconds(0.8), 80 ); 
+    reader.push( s2, base::Time::fromSeconds(0.95), 95 ); 
+    reader.drain();
+    // a closer sample could still follow 0.95
+    BOOST_CHECK( synchronized.empty() );
+
+    reader.push( s2, base::Time::fromSeconds(1.02), 102 ); 
+    reader.push( s2, base::Time::fromSeconds(1.3), 130 ); 
+    reader.push( s2, base::Time::fromSeconds(1.9), 190 ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("b") ); 
+    reader.push( s2, base::Time::fromSeconds(2.6), 260 ); 
+    reader.push( s1, base::Time::fromSeconds(3.0), string("c") ); 
+    reader.push( s2, base::Time::fromSeconds(3.3), 330 ); 
+    reader.drain();
+
+    // the closest sample is chosen, and 3.0 has none within the skew
+    BOOST_REQUIRE_EQUAL( synchronized.size(), 2 );
+    BOOST_CHECK_EQUAL( synchronized[0], "a/102" );
+    BOOST_CHECK_EQUAL( synchronized[1], "b/190" );
+    BOOST_CHECK_EQUAL( reader.getSynchronizerStatus( sync ).matched, 2 );
+    BOOST_CHECK_EQUAL( reader.getSynchronizerStatus( sync ).unmatched, 1 );
+
+    // the samples kept for the synchronizer are accounted apart from the
+    // buffered ones
+    BOOST_CHECK( reader.getRetainedBytes() > 0 );
+    BOOST_CHECK_EQUAL( reader.getStatus().retained_bytes, reader.getRetainedBytes() );
+    reader.removeSynchronizer( sync );
+    BOOST_CHECK_EQUAL( reader.getRetainedBytes(), 0 );
+    BOOST_CHECK_EQUAL( reader.getStatus().retained_bytes, 0 );
+    int s3 = reader.registerStream<int>( &ingest_callback, 0, base::Time::fromSeconds(1) ); 
+    sync_streams.push_back( s3 );
+    sync = reader.addSynchronizer( sync_streams, base::Time::fromSeconds(0.2), &sync_callback );
+    synchronized.clear();
+    reader.push( s1, base::Time::fromSeconds(4.0), string("d") ); 
+    reader.push( s2, base::Time::fromSeconds(3.9), 390 ); 
+    reader.push( s3, base::Time::fromSeconds(3.95), 395 ); 
+    reader.drain();
+    BOOST_CHECK( synchronized.empty() );
+    // the current time excludes a sample closer than 3.95
+    reader.push( s3, base::Time::fromSeconds(4.3), 430 ); 
+    reader.push( s2, base::Time::fromSeconds(4.5), 450 ); 
+    reader.drain();
+    BOOST_REQUIRE_EQUAL( synchronized.size(), 1 );
+    BOOST_CHECK_EQUAL( synchronized[0], "d/390/395" );
+
+    struct check_types
+    {
+	static void callback( const base::Time &ts, const StreamAligner::MatchedSamples &samples )
+	{
+	    BOOST_CHECK( samples.is<string>( 0 ) );
+	    BOOST_CHECK( !samples.is<string>( 1 ) );
+	    BOOST_CHECK_THROW( samples.get<string>( 1 ), std::bad_cast );
+	    BOOST_CHECK_EQUAL( samples.getStreamIndex( 1 ), 1 );
+	    BOOST_CHECK_EQUAL( samples.getTime( 1 ).toSeconds(), 5.0 );
+	}
+    };
+    reader.removeSynchronizer( sync );
+    sync = reader.addSynchronizer( sync_streams, base::Time::fromSeconds(0.2), &check_types::callback );
+    reader.push( s1, base::Time::fromSeconds(5.0), string("e") ); 
+    reader.push( s2, base::Time::fromSeconds(5.0), 500 ); 
+    reader.push( s3, base::Time::fromSeconds(5.0), 500 ); 
+    reader.drain();
+    BOOST_CHECK_EQUAL( reader.getSynchronizerStatus( sync ).matched, 1 );
+
+    // retained streams cannot move their samples out, and unregistering
+    // a stream removes its synchronizers
+    StreamAligner::StreamHandle<copy_counter> handle = reader.registerStream<copy_counter>( StreamAligner::Stream<copy_counter>::callback_t(), 0, base::Time() );
+    sync_streams[0] = handle;
+    reader.addSynchronizer( sync_streams, base::Time::fromSeconds(0.2), &sync_callback );
+    BOOST_CHECK_THROW( reader.setMoveCallback( handle, &move_callback ), std::runtime_error );
+    reader.unregisterStream( s3 );
+    BOOST_CHECK_THROW( reader.removeSynchronizer( sync ), std::runtime_error );
+
+    // samples of equal time on a stream neither hide a closer sample nor
+    // end the search for one, and the first of them is matched
+    StreamAligner duplicates; 
+    duplicates.setTimeout( base::Time::fromSeconds(2.0) );
+    int ref = duplicates.registerStream<string>( &test_callback, 0, base::Time::fromSeconds(1) ); 
+    int other = duplicates.registerStream<int>( &ingest_callback, 0, base::Time::fromSeconds(1) ); 
+    std::vector<int> duplicate_streams;
+    duplicate_streams.push_back( ref );
+    duplicate_streams.push_back( other );
+    duplicates.addSynchronizer( duplicate_streams, base::Time::fromSeconds(0.1), &sync_callback );
+
+    synchronized.clear();
+    duplicates.push( other, base::Time::fromSeconds(1.51), 151 ); 
+    duplicates.push( other, base::Time::fromSeconds(1.52), 152 ); 
+    duplicates.push( other, base::Time::fromSeconds(1.52), 1520 ); 
+    duplicates.push( other, base::Time::fromSeconds(1.56), 156 ); 
+    duplicates.push( ref, base::Time::fromSeconds(1.59), string("a") ); 
+    duplicates.drain();
+    BOOST_CHECK( synchronized.empty() );
+
+    duplicates.push( other, base::Time::fromSeconds(1.62), 162 ); 
+    duplicates.push( other, base::Time::fromSeconds(1.62), 1620 ); 
+    duplicates.push( ref, base::Time::fromSeconds(1.63), string("b") ); 
+    duplicates.drain();
+    // 1.62 is the closest so far, but a closer sample may follow
+    BOOST_REQUIRE_EQUAL( synchronized.size(), 1 );
+
+    duplicates.push( other, base::Time::fromSeconds(1.7), 170 ); 
+    duplicates.drain();
+    BOOST_REQUIRE_EQUAL( synchronized.size(), 2 );
+    BOOST_CHECK_EQUAL( synchronized[0], "a/156" );
+    BOOST_CHECK_EQUAL( synchronized[1], "b/162" );
+}
+
+void pose_callback( const base::Time &time, const base::samples::RigidBodyState &pose )
+{
+}
+
+BOOST_AUTO_TEST_CASE( lookup_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    StreamAligner::StreamHandle<double> s1 = reader.registerStream<double>( StreamAligner::Stream<double>::callback_t(), 0, base::Time::fromSeconds(1) ); 
+    int s2 = reader.registerStream<int>( &ingest_callback, 0, base::Time::fromSeconds(1) ); 
+    reader.setStreamRetention( s1, base::Time::fromSeconds(1.5) );
+
+    BOOST_CHECK( !s1.sampleAt( base::Time::fromSeconds(1.0) ) );
+    for( int i = 1; i <= 4; i++ )
+	s1.push( base::Time::fromSeconds(i), i * 10.0 );
+    reader.push( s2, base::Time::fromSeconds(2.5), 1 ); 
+    for( int i = 0; i < 4; i++ )
+	reader.step();
+    BOOST_CHECK_EQUAL( reader.getCurrentTime().toSeconds(), 3.0 );
+
+    // 1.0 is outside of the retention window of 3.0, 2.0 and 3.0 are
+    // retained and 4.0 is buffered
+    const std::pair<base::Time,double> *sample = s1.sampleAt( base::Time::fromSeconds(0.5) );
+    BOOST_REQUIRE( sample );
+    BOOST_CHECK_EQUAL( sample->second, 20.0 );
+    BOOST_CHECK_EQUAL( s1.sampleAt( base::Time::fromSeconds(2.5) )->second, 20.0 );
+    BOOST_CHECK_EQUAL( s1.sampleAt( base::Time::fromSeconds(2.6) )->second, 30.0 );
+    BOOST_CHECK_EQUAL( s1.sampleAt( base::Time::fromSeconds(9.0) )->second, 40.0 );
+    BOOST_CHECK_EQUAL( s1.sampleAt( base::Time::fromSeconds(2.9), StreamAligner::LOOKUP_BEFORE )->second, 20.0 );
+    BOOST_CHECK_EQUAL( s1.sampleAt( base::Time::fromSeconds(3.0), StreamAligner::LOOKUP_BEFORE )->second, 30.0 );
+    BOOST_CHECK( !s1.sampleAt( base::Time::fromSeconds(1.9), StreamAligner::LOOKUP_BEFORE ) );
+    BOOST_CHECK_EQUAL( reader.sampleAt<double>( s1, base::Time::fromSeconds(2.1), StreamAligner::LOOKUP_AFTER )->second, 30.0 );
+    BOOST_CHECK( !s1.sampleAt( base::Time::fromSeconds(4.1), StreamAligner::LOOKUP_AFTER ) );
+    // the two retained samples are accounted apart from the buffered one
+    BOOST_CHECK_EQUAL( reader.getBufferStatus( s1 ).retained_bytes, 2 * reader.getBufferStatus( s1 ).buffer_bytes );
+
+    // the samples are not copied
+    BOOST_CHECK_EQUAL( sample, s1.sampleAt( base::Time::fromSeconds(2.0) ) );
+
+    const std::pair<base::Time,double> *before = 0, *after = 0;
+    BOOST_REQUIRE( reader.bracketAt( s1, base::Time::fromSeconds(2.75), before, after ) );
+    BOOST_CHECK_EQUAL( before->second, 20.0 );
+    BOOST_CHECK_EQUAL( after->second, 30.0 );
+    BOOST_CHECK( !reader.bracketAt( s1, base::Time::fromSeconds(4.5), before, after ) );
+
+    double value = 0;
+    BOOST_REQUIRE( s1.interpolateAt( base::Time::fromSeconds(2.75), value ) );
+    BOOST_CHECK_CLOSE( value, 27.5, 1e-6 );
+    BOOST_REQUIRE( s1.interpolateAt( base::Time::fromSeconds(4.0), value ) );
+    BOOST_CHECK_EQUAL( value, 40.0 );
+    BOOST_CHECK( !s1.interpolateAt( base::Time::fromSeconds(1.5), value ) );
+
+    struct previous
+    {
+	static void interpolate( const base::Time &t, const std::pair<base::Time,double> &before, const std::pair<base::Time,double> &after, double &result )
+	{
+	    result = before.second;
+	}
+    };
+    BOOST_REQUIRE( reader.interpolateAt( s1, base::Time::fromSeconds(3.5), value, &previous::interpolate ) );
+    BOOST_CHECK_EQUAL( value, 30.0 );
+
+    // the retained samples are removed as the stream plays out newer ones
+    reader.push( s2, base::Time::fromSeconds(4.5), 2 ); 
+    reader.drain();
+    BOOST_CHECK( !s1.sampleAt( base::Time::fromSeconds(2.5), StreamAligner::LOOKUP_BEFORE ) );
+    BOOST_CHECK_EQUAL( s1.sampleAt( base::Time::fromSeconds(2.5) )->second, 30.0 );
+
+    StreamAligner::StreamHandle<base::samples::RigidBodyState> poses = 
+	reader.registerStream<base::samples::RigidBodyState>( &pose_callback, 0, base::Time() ); 
+    base::samples::RigidBodyState pose;
+    pose.position = Eigen::Vector3d( 0, 0, 0 );
+    pose.orientation = Eigen::Quaterniond::Identity();
+    pose.velocity = Eigen::Vector3d( 1, 0, 0 );
+    pose.angular_velocity = Eigen::Vector3d( 0, 0, 0 );
+    poses.push( base::Time::fromSeconds(5.0), pose );
+    pose.position = Eigen::Vector3d( 2, 0, 0 );
+    pose.orientation = Eigen::Quaterniond( Eigen::AngleAxisd( M_PI / 2, Eigen::Vector3d::UnitZ() ) );
+    pose.velocity = Eigen::Vector3d( 3, 0, 0 );
+    poses.push( base::Time::fromSeconds(6.0), pose );
+
+    base::samples::RigidBodyState result;
+    BOOST_REQUIRE( poses.interpolateAt( base::Time::fromSeconds(5.5), result ) );
+    BOOST_CHECK( result.time == base::Time::fromSeconds(5.5) );
+    BOOST_CHECK_CLOSE( result.position.x(), 1.0, 1e-6 );
+    BOOST_CHECK_CLOSE( result.velocity.x(), 2.0, 1e-6 );
+    BOOST_CHECK_CLOSE( result.orientation.angularDistance( Eigen::Quaterniond::Identity() ), M_PI / 4, 1e-6 );
+
+    BOOST_CHECK_THROW( reader.setStreamRetention( -1, base::Time::fromSeconds(1.0) ), std::out_of_range );
+}
+
+BOOST_AUTO_TEST_CASE( time_histogram_test )
+{
+    TimeHistogram histogram;
+    BOOST_CHECK( histogram.getPercentile( 0.5 ).isNull() );
+
+    // exact below the first power of two, then within 1/8 
+    for( int64_t us = 0; us < 100000; us++ )
+    {
+	int bucket = TimeHistogram::getBucket( us );
+	BOOST_REQUIRE( TimeHistogram::getBucketLimit( bucket ) >= us );
+	BOOST_REQUIRE( TimeHistogram::getBucketLimit( bucket ) <= us + us / 8 );
+	if( bucket > 0 )
+	    BOOST_REQUIRE( TimeHistogram::getBucketLimit( bucket - 1 ) < us );
+    }
+    BOOST_CHECK_EQUAL( TimeHistogram::getBucket( int64_t(1) << 50 ), TimeHistogram::bucket_count - 1 );
+
+    for( int i = 1; i <= 1000; i++ )
+	histogram.add( base::Time::fromMilliseconds( i ) );
+    BOOST_CHECK_EQUAL( histogram.getCount(), 1000 );
+    BOOST_CHECK_CLOSE( histogram.getPercentile( 0.5 ).toSeconds(), 0.5, 12.5 );
+    BOOST_CHECK_CLOSE( histogram.getPercentile( 0.99 ).toSeconds(), 0.99, 12.5 );
+    BOOST_CHECK_EQUAL( histogram.getPercentile( 1.0 ).toSeconds(), 1.0 );
+    BOOST_CHECK_EQUAL( histogram.getMax().toSeconds(), 1.0 );
+}
+
+BOOST_AUTO_TEST_CASE( latency_statistics_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+    reader.setLatencyStatistics( true );
+
+    int s1 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1) ); 
+    int s2 = reader.registerStream<string>( &record_callback, 10, base::Time::fromSeconds(1) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("b") ); 
+    std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+    reader.push( s2, base::Time::fromSeconds(3.5), string("c") ); 
+    BOOST_CHECK_EQUAL( reader.drain().first, 2 );
+
+    const StreamLatencyStatus &status( reader.getLatencyStatus( s1 ) );
+    BOOST_CHECK_EQUAL( status.residency_time.getCount(), 2 );
+    BOOST_CHECK( status.residency_time.getPercentile( 0.5 ) >= base::Time::fromMilliseconds(10) );
+    // a is released 2.5 seconds behind c, b 1.5 seconds
+    BOOST_CHECK_EQUAL( status.release_lag.getCount(), 2 );
+    BOOST_CHECK_EQUAL( status.release_lag.getMax().toSeconds(), 2.5 );
+    BOOST_CHECK_CLOSE( status.release_lag.getPercentile( 0.0 ).toSeconds(), 1.5, 12.5 );
+    BOOST_CHECK_EQUAL( reader.getLatencyStatus( s2 ).release_lag.getCount(), 0 );
+
+    reader.clear();
+    BOOST_CHECK_EQUAL( reader.getLatencyStatus( s1 ).residency_time.getCount(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( status_snapshot_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+
+    int s1 = reader.registerStream<string>( &record_callback, 0, base::Time::fromSeconds(1), -1, "s1" ); 
+    int s2 = reader.registerStream<string>( &record_callback, 0, base::Time::fromSeconds(1), -1, "s2" ); 
+
+    // nothing published yet
+    BOOST_CHECK( reader.readStatus().streams.empty() );
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.publishStatus();
+    const StreamAlignerStatus &status( reader.readStatus() );
+    BOOST_REQUIRE_EQUAL( status.streams.size(), 2 );
+    BOOST_CHECK_EQUAL( status.streams[s1].name, "s1" );
+    BOOST_CHECK_EQUAL( status.streams[s1].buffer_fill, 1 );
+    BOOST_CHECK_EQUAL( status.streams[s2].name, "s2" );
+
+    // changed streams get updated, and keep their name
+    reader.push( s2, base::Time::fromSeconds(1.5), string("b") ); 
+    reader.step();
+    reader.publishStatus();
+    const StreamAlignerStatus &status2( reader.readStatus() );
+    BOOST_CHECK_EQUAL( status2.streams[s1].buffer_fill, 0 );
+    BOOST_CHECK_EQUAL( status2.streams[s1].samples_processed, 1 );
+    BOOST_CHECK_EQUAL( status2.streams[s1].name, "s1" );
+    BOOST_CHECK_EQUAL( status2.streams[s2].buffer_fill, 1 );
+    BOOST_CHECK_EQUAL( status2.current_time.toSeconds(), 1.0 );
+
+    // reading again without a new publication returns the same snapshot
+    BOOST_CHECK_EQUAL( &reader.readStatus(), &status2 );
+
+    // a stream registered in a freed slot gets its own name
+    reader.unregisterStream( s1 );
+    reader.publishStatus();
+    BOOST_CHECK( !reader.readStatus().streams[s1].active );
+    int s3 = reader.registerStream<string>( &record_callback, 0, base::Time::fromSeconds(1), -1, "s3" ); 
+    BOOST_CHECK_EQUAL( s3, s1 );
+    for( int i = 0; i < 3; i++ )
+	reader.publishStatus();
+    BOOST_CHECK_EQUAL( reader.readStatus().streams[s3].name, "s3" );
+    BOOST_CHECK( reader.readStatus().streams[s3].active );
+    BOOST_CHECK_EQUAL( reader.getStatus().streams[s3].name, "s3" );
+
+    // a monitoring thread reads while the aligner runs
+    std::atomic<bool> done( false );
+    size_t last_received = 0;
+    bool monotonic = true;
+    std::thread monitor( [&]()
+    {
+	while( !done )
+	{
+	    const StreamAlignerStatus &snapshot( reader.readStatus() );
+	    if( snapshot.streams[s2].samples_received < last_received || snapshot.streams[s2].name != "s2" )
+		monotonic = false;
+	    last_received = snapshot.streams[s2].samples_received;
+	}
+    } );
+    for( int i = 0; i < 20000; i++ )
+    {
+	reader.push( s2, base::Time::fromSeconds(2.0 + i * 0.001), string("c") ); 
+	reader.drain();
+	reader.publishStatus();
+    }
+    done = true;
+    monitor.join();
+    BOOST_CHECK( monotonic );
+    BOOST_CHECK_EQUAL( reader.readStatus().streams[s2].samples_received, 20001 );
+}
+
+BOOST_AUTO_TEST_CASE( stream_trace_test )
+{
+    StreamAligner reader; 
+    reader.setTimeout( base::Time::fromSeconds(2.0) );
+    StreamTrace trace( 16 );
+    reader.setTrace( &trace );
+
+    int s1 = reader.registerStream<string>( &record_callback, 2, base::Time::fromSeconds(1) ); 
+    int s2 = reader.registerStream<string>( &record_callback, 2, base::Time::fromSeconds(0.5) ); 
+
+    reader.push( s1, base::Time::fromSeconds(1.0), string("a") ); 
+    reader.push( s1, base::Time::fromSeconds(2.0), string("b") ); 
+    // drops a
+    reader.push( s1, base::Time::fromSeconds(3.0), string("c") ); 
+    reader.push( s1, base::Time::fromSeconds(2.5), string("d") ); 
+    reader.push( s2, base::Time::fromSeconds(2.0), string("e") ); 
+    // b and e
+    BOOST_CHECK_EQUAL( reader.drain().first, 2 );
+    reader.push( s2, base::Time::fromSeconds(1.5), string("f") ); 
+
+    std::vector<TraceRecord> records;
+    trace.getRecords( records );
+    BOOST_REQUIRE_EQUAL( records.size(), 9 );
+    BOOST_CHECK_EQUAL( records[0].event, TRACE_PUSH );
+    BOOST_CHECK_EQUAL( records[2].event, TRACE_DROPPED_BUFFER_FULL );
+    BOOST_CHECK_EQUAL( records[2].time, 1000000 );
+    BOOST_CHECK_EQUAL( records[3].event, TRACE_PUSH );
+    BOOST_CHECK_EQUAL( records[4].event, TRACE_DROPPED_BACKWARD );
+    BOOST_CHECK_EQUAL( records[5].stream, s2 );
+    BOOST_CHECK_EQUAL( records[6].event, TRACE_RELEASE );
+    BOOST_CHECK_EQUAL( records[6].stream, s1 );
+    BOOST_CHECK_EQUAL( records[6].time, 2000000 );
+    BOOST_CHECK_EQUAL( records[7].event, TRACE_RELEASE );
+    BOOST_CHECK_EQUAL( records[7].stream, s2 );
+    BOOST_CHECK_EQUAL( records[8].event, TRACE_DROPPED_LATE );
+    BOOST_CHECK( records[6].wall_time >= records[0].wall_time );
+
+    const std::string path = "stream_trace_test.bin";
+    trace.save( path );
+    StreamTraceReader reader_file( path );
+    BOOST_CHECK_EQUAL( reader_file.getRecords().size(), 9 );
+    BOOST_CHECK_EQUAL( reader_file.count( TRACE_PUSH ), 4 );
+    BOOST_CHECK_EQUAL( reader_file.count( TRACE_RELEASE, s2 ), 1 );
+
+    std::vector<TimeHistogram> residency, lag;
+    reader_file.computeLatencies( residency, lag );
+    BOOST_REQUIRE_EQUAL( lag.size(), 2 );
+    BOOST_CHECK_EQUAL( lag[s1].getCount(), 1 );
+    BOOST_CHECK_EQUAL( lag[s1].getMax().toSeconds(), 1.0 );
+    BOOST_CHECK_EQUAL( residency[s2].getCount(), 1 );
+
+    // the ring keeps the newest records
+    for( int i = 0; i < 20; i++ )
+	reader.push( s2, base::Time::fromSeconds(1.0), string("g") ); 
+    trace.getRecords( records );
+    BOOST_CHECK_EQUAL( records.size(), 16 );
+    BOOST_CHECK_EQUAL( trace.getLostCount(), 13 );
+    BOOST_CHECK_EQUAL( records.back().event, TRACE_DROPPED_LATE );
+    trace.save( path );
+    BOOST_CHECK_EQUAL( StreamTraceReader( path ).getRecords().size(), 16 );
+    BOOST_CHECK_EQUAL( StreamTraceReader( path ).getLostCount(), 13 );
+    {
+	MappedStreamTrace mapped( path );
+	BOOST_REQUIRE_EQUAL( mapped.size(), 16 );
+	BOOST_CHECK_EQUAL( mapped.getLostCount(), 13 );
+	BOOST_CHECK_EQUAL( mapped[15].event, TRACE_DROPPED_LATE );
+	BOOST_CHECK_EQUAL( mapped.begin()->wall_time, records.front().wall_time );
+    }
+    std::remove( path.c_str() );
+
+    BOOST_CHECK_THROW( StreamTraceReader( "does_not_exist.bin" ), std::runtime_error );
+    BOOST_CHECK_THROW( MappedStreamTrace( "does_not_exist.bin" ), std::runtime_error );
+
+    // the releases of reordered samples are matched with their push
+    StreamAligner reordering; 
+    reordering.setTimeout( base::Time::fromSeconds(2.0) );
+    StreamTrace reorder_trace( 16 );
+    reordering.setTrace( &reorder_trace );
+    int s3 = reordering.registerStream<string>( &record_callback, 0, base::Time::fromSeconds(1) ); 
+    reordering.setStreamReorderWindow( s3, base::Time::fromSeconds(1.5) );
+    reordering.push( s3, base::Time::fromSeconds(1.0), string("a") ); 
+    reordering.push( s3, base::Time::fromSeconds(3.0), string("c") ); 
+    reordering.push( s3, base::Time::fromSeconds(2.0), string("b") ); 
+    reordering.setTimeout( base::Time() );
+    BOOST_CHECK_EQUAL( reordering.drain().first, 3 );
+    reorder_trace.save( path );
+    StreamTraceReader( path ).computeLatencies( residency, lag );
+    std::remove( path.c_str() );
+    BOOST_REQUIRE_EQUAL( residency.size(), 1 );
+    BOOST_CHECK_EQUAL( residency[s3].getCount(), 3 );
+    BOOST_CHECK_EQUAL( lag[s3].getMax().toSeconds(), 2.0 );
+}